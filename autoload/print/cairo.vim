@@ -6,101 +6,151 @@
 "   NUMBER numberwidth
 "   LINESPACE height
 "   FONT name size
+"   PAGES first last
+"   TITLE title
+"   HIGHDEF id name fg bg sp bold italic underline undercurl
 "   START
 "   LINE
-"   HIGHLIGHT name fg bg sp bold italic underline undercurl
-"   TEXT text
+"   RUN id text
 "   END
+"
+" HIGHDEF defines highlight id once, before the first run using it.
+" Normal is defined before START, as it gives the page colors.  RUN
+" prints text in highlight id.  The backend still reads the older form
+" of a run, "HIGHLIGHT name fg bg sp bold italic underline undercurl"
+" followed by "TEXT text", which is not written here.
+"
+" The third argument of print#cairo#dump() holds the options of
+" print#writer#new(): {'binary': 1} writes the binary format and
+" {'command': [backend]} streams the commands into the backend, in which
+" case outfile names the printed file.  {'cache': 1} keeps the syntax of
+" each line in outfile.cache and only extracts changed lines on the next
+" dump.  With a command it also passes --cache to the backend, which then
+" keeps a hash of each page in outfile.pages and only writes the png, ppm
+" or svg files of changed pages.  A pdf or ps is drawn whole each time, as
+" cairo cannot copy pages from an earlier file.
+" {'pages': [first, last]} prints pages first to last (0 for the last
+" page).  With a command the backend is asked for the rows and columns of
+" a page, and lines that cannot reach the pages are not extracted.
+"
+" print#cairo#dump_buffers() dumps several buffers as documents of one
+" output.  Each document has its own page numbers and outline entry.
 
 function! print#cairo#dump(outfile, ...)
   let mode = get(a:000, 0, {})
-  call s:dump(a:outfile, mode)
+  let opts = get(a:000, 1, {})
+  call s:dump(a:outfile, [bufnr('%')], mode, opts)
 endfunction
 
-function! s:dump(outfile, mode)
-  let syntax = print#syntax#new(a:mode)
-
-  let out = []
-
-  call add(out, s:paper(595, 842))
-  call add(out, s:margin(25, 25, 25, 25))
-  call add(out, s:header(expand('%:t') . '%=Page %N', 1))
-  call add(out, s:number(6))
-  call add(out, s:linespace(2))
-  call add(out, s:font('Courier', 10))
-  call add(out, s:start())
-
-  for lnum in range(1, line('$'))
-    call add(out, s:line())
-    for [str, attr] in syntax.synline(lnum)
-      call add(out, s:highlight(attr))
-      call add(out, s:text(str))
-    endfor
-  endfor
-
-  call add(out, s:end())
-
-  call writefile(out, a:outfile)
-endfunction
-
-function! s:paper(width, height)
-  return printf('PAPER %f %f', a:width, a:height)
-endfunction
-
-function! s:margin(left, top, right, bottom)
-  return printf('MARGIN %f %f %f %f', a:left, a:top, a:right, a:bottom)
-endfunction
-
-function! s:header(format, extraline)
-  return printf('HEADER %s %d', s:string(a:format), a:extraline)
+function! print#cairo#dump_buffers(outfile, bufnrs, ...)
+  let mode = get(a:000, 0, {})
+  let opts = get(a:000, 1, {})
+  call s:dump(a:outfile, a:bufnrs, mode, opts)
 endfunction
 
-function! s:number(numberwidth)
-  return printf('NUMBER %d', a:numberwidth)
+function! s:dump(outfile, bufnrs, mode, opts)
+  let opts = a:opts
+  if get(opts, 'cache', 0) && has_key(opts, 'command')
+    let opts = extend(copy(opts), {'command': opts.command + ['--cache']})
+  endif
+  let out = print#writer#new(a:outfile, opts)
+  let bufnr = bufnr('%')
+  let hidden = &hidden
+  set hidden
+  try
+    for i in range(len(a:bufnrs))
+      if a:bufnrs[i] != bufnr('%')
+        execute 'keepalt buffer' a:bufnrs[i]
+      endif
+      " Each buffer keeps its own cache.
+      let cache = len(a:bufnrs) == 1 ? a:outfile . '.cache'
+            \ : printf('%s.%d.cache', a:outfile, i)
+      call s:document(out, cache, a:mode, a:opts)
+    endfor
+  finally
+    if bufnr('%') != bufnr
+      execute 'keepalt buffer' bufnr
+    endif
+    let &hidden = hidden
+  endtry
+  call out.close()
 endfunction
 
-function! s:linespace(height)
-  return printf('LINESPACE %f', a:height)
-endfunction
+function! s:document(out, cache, mode, opts)
+  let out = a:out
+  let syntax = print#syntax#new(a:mode)
+  if get(a:opts, 'cache', 0)
+    call syntax.load_cache(a:cache)
+  endif
+
+  let layout = {
+        \ 'paper': [595.0, 842.0],
+        \ 'margin': [25.0, 25.0, 25.0, 25.0],
+        \ 'extraline': 1,
+        \ 'number': 6,
+        \ 'linespace': 2.0,
+        \ 'size': 10.0,
+        \ }
+
+  call s:layout(out, layout)
+  call out.command('TITLE', expand('%:t'))
+  let pages = get(a:opts, 'pages', [])
+  if empty(pages)
+    let [plain, last] = [0, line('$')]
+  else
+    call out.commandlist('PAGES', pages)
+    " Without a command the dump may be printed with other fonts.
+    let geometry = !has_key(a:opts, 'command') ? []
+          \ : print#pages#geometry(a:opts.command,
+          \   {out -> s:layout(out, layout)})
+    let [plain, last] = print#pages#lines(geometry, pages[0], pages[1])
+  endif
+  " Normal gives the page colors, so it is defined before START.  Each
+  " highlight is defined once and runs refer to it by id.
+  let normal = syntax.synattr(hlID('Normal'))
+  call out.commandlist('HIGHDEF', [normal.id] + s:highlight(normal))
+  let defined = {normal.id : 1}
+
+  call out.command('START')
+
+  for lnum in range(1, last)
+    call out.command('LINE')
+    let runs = lnum <= plain ? syntax.plainline(lnum) : syntax.synline(lnum)
+    for [str, attr] in runs
+      if !has_key(defined, attr.id)
+        call out.commandlist('HIGHDEF', [attr.id] + s:highlight(attr))
+        let defined[attr.id] = 1
+      endif
+      call out.command('RUN', attr.id, str)
+    endfor
+  endfor
 
-function! s:font(name, size)
-  return printf('FONT %s %d', s:string(a:name), a:size)
-endfunction
+  call out.command('END')
 
-function! s:text(s)
-  return printf('TEXT %s', s:string(a:s))
+  if get(a:opts, 'cache', 0)
+    call syntax.save_cache()
+  endif
 endfunction
 
-function! s:line()
-  return 'LINE'
+function! s:layout(out, layout)
+  call a:out.commandlist('PAPER', a:layout.paper)
+  call a:out.commandlist('MARGIN', a:layout.margin)
+  call a:out.command('HEADER', expand('%:t') . '%=Page %N',
+        \ a:layout.extraline)
+  call a:out.command('NUMBER', a:layout.number)
+  call a:out.command('LINESPACE', a:layout.linespace)
+  call a:out.command('FONT', 'Courier', a:layout.size)
 endfunction
 
 function! s:highlight(attr)
   " Normal's attribute does not effect.
-  return printf("HIGHLIGHT %s %s %s %s %d %d %d %d",
-        \ s:string(a:attr.name),
-        \ s:color(a:attr.fg),
-        \ s:color(a:attr.bg),
-        \ s:color(a:attr.sp),
-        \ (a:attr.transname == 'Normal' ? 0 : a:attr.bold),
-        \ (a:attr.transname == 'Normal' ? 0 : a:attr.italic),
-        \ (a:attr.transname == 'Normal' ? 0 : a:attr.underline),
-        \ (a:attr.transname == 'Normal' ? 0 : a:attr.undercurl))
-endfunction
-
-function! s:start()
-  return "START"
+  return [
+        \ a:attr.name,
+        \ a:attr.fg,
+        \ a:attr.bg,
+        \ a:attr.sp,
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.bold)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.italic)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.underline)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.undercurl))]
 endfunction
-
-function! s:end()
-  return "END"
-endfunction
-
-function! s:string(s)
-  return '"' . escape(a:s, '"\') . '"'
-endfunction
-
-function! s:color(color)
-  return printf('#%02x%02x%02x', a:color[0], a:color[1], a:color[2])
-endfunction
-
@@ -0,0 +1,52 @@
+" Lines of a buffer that can reach a range of pages, for the dumpers.
+
+" Returns [rows, columns] of a page as the backend command lays out the
+" commands Layout(out) writes before START, see its --geometry.  [] when
+" the backend does not tell.
+function! print#pages#geometry(command, Layout)
+  let tmp = tempname()
+  let out = print#writer#new(tmp, {})
+  call a:Layout(out)
+  call out.command('START')
+  call out.close()
+  let cmd = join(map(a:command + ['--geometry', tmp], 'shellescape(v:val)'))
+  let res = filter(systemlist(cmd), 'v:val =~# "^\\d\\+ \\d\\+$"')
+  call delete(tmp)
+  if v:shell_error || empty(res)
+    return []
+  endif
+  return map(split(res[0]), 'str2nr(v:val)')
+endfunction
+
+" Returns [plain, last]: lines up to plain end before page first and lines
+" after last start after page last.  Every line takes at least one of the
+" rows of a page.  A line of printable ASCII takes one row per columns
+" cells of a fixed pitch font, while other lines can take any number, so
+" plain stops before the first of them.  Without geometry every line is
+" sent with its syntax.
+function! print#pages#lines(geometry, first, last)
+  if empty(a:geometry)
+    return [0, line('$')]
+  endif
+  let [rows, columns] = a:geometry
+
+  let last = line('$')
+  if a:last != 0
+    let last = min([last, a:last * rows])
+  endif
+
+  let plain = 0
+  let used = 0
+  for lnum in range(1, columns > 0 ? last : 0)
+    let line = getline(lnum)
+    if line =~ '[^ -~]'
+      break
+    endif
+    let used += max([1, (len(line) + columns - 1) / columns])
+    if used > (a:first - 1) * rows
+      break
+    endif
+    let plain = lnum
+  endfor
+  return [plain, last]
+endfunction
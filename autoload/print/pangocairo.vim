@@ -5,103 +5,99 @@
 "   HEADER format extraline
 "   NUMBER numberwidth
 "   FONT name size
+"   PAGES first last
 "   START
-"   LINE text
+"   LINE markup
+"   HIGHDEF id name fg bg sp bold italic underline undercurl
+"   SPANS count [id start end]... text
 "   END
+"
+" SPANS is a line of plain text.  Each span applies highlight id to the
+" bytes from start to end of text.
+"
+" The third argument of print#pangocairo#dump() holds the options of
+" print#writer#new(): {'binary': 1} writes the binary format and
+" {'command': [backend]} streams the commands into the backend, in which
+" case outfile names the printed file.  {'cache': 1} keeps the syntax of
+" each line in outfile.cache and only extracts changed lines on the next
+" dump.  {'pages': [first, last]} prints pages first to last (0 for the
+" last page).  With a command the backend is asked for the rows and
+" columns of a page, and lines that cannot reach the pages are not
+" extracted, or not sent when they come after the pages.
 
 function! print#pangocairo#dump(outfile, ...)
   let mode = get(a:000, 0, {})
-  call s:dump(a:outfile, mode)
+  let opts = get(a:000, 1, {})
+  call s:dump(a:outfile, mode, opts)
 endfunction
 
-function! s:dump(outfile, mode)
+function! s:dump(outfile, mode, opts)
   let syntax = print#syntax#new(a:mode)
+  if get(a:opts, 'cache', 0)
+    call syntax.load_cache(a:outfile . '.cache')
+  endif
 
-  let out = []
-
-  call add(out, s:paper(595, 842))
-  call add(out, s:margin(25, 25, 25, 25))
-  call add(out, s:header(expand('%:t') . '%=Page %N', 1))
-  call add(out, s:number(6))
-  call add(out, s:font('Monospace', 6))
-  call add(out, s:start())
-
-  for lnum in range(1, line('$'))
-    let markups = []
-    for [str, attr] in syntax.synline(lnum)
-      call add(markups, s:markup(str, attr))
+  let out = print#writer#new(a:outfile, a:opts)
+
+  call s:layout(out)
+  let pages = get(a:opts, 'pages', [])
+  if empty(pages)
+    let [plain, last] = [0, line('$')]
+  else
+    call out.commandlist('PAGES', pages)
+    let geometry = !has_key(a:opts, 'command') ? []
+          \ : print#pages#geometry(a:opts.command, function('s:layout'))
+    let [plain, last] = print#pages#lines(geometry, pages[0], pages[1])
+  endif
+  call out.command('START')
+
+  let defined = {}
+  for lnum in range(1, last)
+    let runs = lnum <= plain ? syntax.plainline(lnum) : syntax.synline(lnum)
+    let text = join(map(copy(runs), 'v:val[0]'), '')
+    " Offsets are bytes of the text as sent, which the writer converts to
+    " UTF-8.  Conversion is per character, so runs convert alike.
+    let convert = print#writer#utf8(text) !=# text
+    let spans = []
+    let pos = 0
+    for [str, attr] in runs
+      if !has_key(defined, attr.id)
+        call out.commandlist('HIGHDEF', [attr.id] + s:highlight(attr))
+        let defined[attr.id] = 1
+      endif
+      let n = len(convert ? print#writer#utf8(str) : str)
+      call extend(spans, [attr.id, pos, pos + n])
+      let pos += n
     endfor
-    call add(out, s:line(join(markups, '')))
+    call out.commandlist('SPANS', [len(spans) / 3] + spans + [text])
   endfor
 
-  call add(out, s:end())
-
-  call writefile(out, a:outfile)
-endfunction
-
-function! s:paper(width, height)
-  return printf('PAPER %f %f', a:width, a:height)
-endfunction
-
-function! s:margin(left, top, right, bottom)
-  return printf('MARGIN %f %f %f %f', a:left, a:top, a:right, a:bottom)
-endfunction
-
-function! s:header(format, extraline)
-  return printf('HEADER %s %d', s:string(a:format), a:extraline)
-endfunction
-
-function! s:number(numberwidth)
-  return printf('NUMBER %d', a:numberwidth)
-endfunction
+  call out.command('END')
 
-function! s:font(name, size)
-  return printf('FONT %s %d', s:string(a:name), a:size)
-endfunction
-
-function! s:line(s)
-  return printf('LINE %s', s:string(a:s))
-endfunction
-
-function! s:start()
-  return "START"
-endfunction
-
-function! s:end()
-  return "END"
-endfunction
-
-function! s:string(s)
-  return '"' . escape(a:s, '"\') . '"'
-endfunction
+  if get(a:opts, 'cache', 0)
+    call syntax.save_cache()
+  endif
 
-function! s:color(color)
-  return printf('#%02x%02x%02x', a:color[0], a:color[1], a:color[2])
+  call out.close()
 endfunction
 
-function! s:markup(text, attr)
-  let s:entity = {'<':'&lt;', '>':'&gt;', '&': '&amp;'}
-  let text = substitute(a:text, '<\|>\|&', '\=s:entity[submatch(0)]', 'g')
-  let attrs = ''
-  let attrs .= printf(' fgcolor="%s"', s:color(a:attr.fg))
-  if !s:is_white(a:attr.bg)
-    let attrs .= printf(' bgcolor="%s"', s:color(a:attr.bg))
-  endif
-  if a:attr.transname != 'Normal'
-    if a:attr.bold
-      let attrs .= ' font_weight="bold"'
-    endif
-    if a:attr.italic
-      let attrs .= ' font_style="italic"'
-    endif
-    if a:attr.underline
-      let attrs .= ' underline="single"'
-    endif
-  endif
-  return printf('<span %s>%s</span>', attrs, text)
+function! s:layout(out)
+  call a:out.command('PAPER', 595.0, 842.0)
+  call a:out.command('MARGIN', 25.0, 25.0, 25.0, 25.0)
+  call a:out.command('HEADER', expand('%:t') . '%=Page %N', 1)
+  call a:out.command('NUMBER', 6)
+  call a:out.command('FONT', 'Monospace', 6.0)
 endfunction
 
-function! s:is_white(color)
-  return a:color[0] == 255 && a:color[1] == 255 && a:color[2] == 255
+function! s:highlight(attr)
+  " Normal's attribute does not effect.
+  return [
+        \ a:attr.name,
+        \ a:attr.fg,
+        \ a:attr.bg,
+        \ a:attr.sp,
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.bold)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.italic)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.underline)),
+        \ (a:attr.transname == 'Normal' ? 0 : str2nr(a:attr.undercurl))]
 endfunction
-
@@ -6,6 +6,8 @@ endfunction
 
 let s:syntax = {}
 
+let s:CACHE_VERSION = 2
+
 function s:syntax.new(mode)
   let obj = deepcopy(self)
   call obj.__init__(a:mode)
@@ -25,6 +27,88 @@ function s:syntax.__init__(mode)
     let self.mode = a:mode
   endif
   let self.cache = {}
+  let self.linecache = v:null
+endfunction
+
+" Load the run lists of a previous dump from path.  synline() then only
+" extracts lines whose text or syntax state at the start changed, and
+" save_cache() writes the lines of this dump back to path.  Syntaxes whose
+" state is not told by the open groups are not cached, see s:cacheable().
+function s:syntax.load_cache(path)
+  if !s:cacheable(execute('syntax list'))
+    return
+  endif
+  let self.cache_path = a:path
+  let self.linecache = {}
+  let self.newcache = {}
+  if filereadable(a:path)
+    try
+      let data = json_decode(readfile(a:path)[0])
+      if data.version == s:CACHE_VERSION && data.syntax ==# &syntax
+            \ && data.options == s:cache_options()
+        let self.linecache = data.lines
+      endif
+    catch
+      " A broken cache is rebuilt.
+    endtry
+  endif
+endfunction
+
+function s:syntax.save_cache()
+  if self.linecache is v:null
+    return
+  endif
+  call writefile([json_encode({
+        \ 'version': s:CACHE_VERSION,
+        \ 'syntax': &syntax,
+        \ 'options': s:cache_options(),
+        \ 'lines': self.newcache,
+        \ })], self.cache_path)
+endfunction
+
+" The state at the end of a line is keyed by the names of the open syntax
+" groups.  It does not hold matches that continue on the next line, \z()
+" external groups or a nextgroup pending over skipnl or skipempty.  Nor
+" does a name tell apart regions of one group that differ in more than
+" their start, such as their end.  items is the output of :syntax list.
+function! s:cacheable(items)
+  if a:items =~# '\\z(\|\\n\|\\_\|\<skipnl\>\|\<skipempty\>'
+    return 0
+  endif
+  " Each item of a group is listed on a line of its own, the first one
+  " after the group name.  A pattern is listed between two of a character
+  " it does not hold, followed by its offsets.
+  let regions = {}
+  let group = ''
+  for line in split(a:items, "\n")
+    if line =~# '^\S'
+      let group = matchstr(line, '^\S\+')
+    endif
+    if line !~# '\<start='
+      continue
+    endif
+    let item = substitute(line, '^\S\+\s\+xxx\|\<start=\(\S\).\{-}\1\S*',
+          \ '', 'g')
+    let item = substitute(item, '^\s\+\|\s\+$', '', 'g')
+    let item = substitute(item, '\s\+', ' ', 'g')
+    if get(regions, group, item) !=# item
+      return 0
+    endif
+    let regions[group] = item
+  endfor
+  return 1
+endfunction
+
+" Options that change the text or width of the runs extracted for a line.
+function! s:cache_options()
+  return {
+        \ 'tabstop': &tabstop,
+        \ 'vartabstop': exists('&vartabstop') ? &vartabstop : '',
+        \ 'isprint': &isprint,
+        \ 'display': &display,
+        \ 'encoding': &encoding,
+        \ 'ambiwidth': &ambiwidth,
+        \ }
 endfunction
 
 function s:syntax.hi()
@@ -43,10 +127,38 @@ function s:syntax.hi()
 endfunction
 
 function s:syntax.synline(lnum)
+  if self.linecache is v:null
+    return self.extract(a:lnum)
+  endif
+  " Highlighting of a line is decided by its text and the syntax items
+  " still open at the end of the previous line.
+  if a:lnum == 1
+    let state = []
+  else
+    let state = map(synstack(a:lnum - 1, len(getline(a:lnum - 1)) + 1),
+          \ 'synIDattr(v:val, "name")')
+  endif
+  let key = sha256(join(state, ',') . "\n" . getline(a:lnum))
+  if has_key(self.linecache, key)
+    let res = map(copy(self.linecache[key]),
+          \ '[v:val[0], self.synattr(hlID(v:val[1]))]')
+  else
+    let res = self.extract(a:lnum)
+  endif
+  let self.newcache[key] = map(copy(res), '[v:val[0], v:val[1].name]')
+  return res
+endfunction
+
+function s:syntax.extract(lnum)
+  let line = getline(a:lnum)
+  " Printable ASCII is always displayed as is, one cell per byte.
+  if line !~ '[^ -~]'
+    return self.synline_ascii(a:lnum, line)
+  endif
   let res = []
   let col = 1
   let vcol = 0
-  for c in split(getline(a:lnum), '\zs')
+  for c in split(line, '\zs')
     let vw = strdisplaywidth(c, vcol)
     if c == "\t"
       let attr = self.synattr(synID(a:lnum, col, 1))
@@ -73,6 +185,43 @@ function s:syntax.synline(lnum)
   return res
 endfunction
 
+" Runs of a line without syntax, for lines that are only laid out.
+function s:syntax.plainline(lnum)
+  let line = getline(a:lnum)
+  if line =~ '[^ -~]'
+    return self.synline(a:lnum)
+  endif
+  return empty(line) ? [] : [[line, self.synattr(0)]]
+endfunction
+
+" Scan synID() over byte ranges and look up the attribute only when the
+" syntax id changes.
+function s:syntax.synline_ascii(lnum, line)
+  let res = []
+  let start = 0
+  let prev = -1
+  let attr = {}
+  for col in range(1, len(a:line))
+    let id = synID(a:lnum, col, 1)
+    if id == prev
+      continue
+    endif
+    let prev = id
+    let next = self.synattr(id)
+    if empty(attr)
+      let attr = next
+    elseif next.id != attr.id
+      call add(res, [a:line[start : col - 2], attr])
+      let start = col - 1
+      let attr = next
+    endif
+  endfor
+  if !empty(attr)
+    call add(res, [a:line[start :], attr])
+  endif
+  return res
+endfunction
+
 function s:syntax.synattr(id)
   if has_key(self.cache, a:id)
     return self.cache[a:id]
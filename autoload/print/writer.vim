@@ -0,0 +1,194 @@
+
+" Writer of the intermediate format.
+"
+" options:
+"   binary   write the binary format described in backend/common/lexer.h
+"   command  backend command as a List, e.g. ['backend/cairo/print'].
+"            The backend is started as "command - outfile" and commands
+"            are sent to it in batches while they are generated, instead
+"            of writing outfile as a dump.
+"
+" Arguments of commands are encoded by type:
+"   Float   float
+"   Number  integer
+"   String  string
+"   List    color [r, g, b]
+" so pass a Float where the backend reads a float.  Strings are converted
+" from 'encoding' to UTF-8 in both formats.
+
+function! print#writer#new(outfile, ...)
+  let opts = get(a:000, 0, {})
+  return s:writer.new(a:outfile, opts)
+endfunction
+
+" Returns str as the writer sends it.
+function! print#writer#utf8(str)
+  return s:utf8(a:str)
+endfunction
+
+" Commands (text) or bytes (binary) sent to the backend at once.
+let s:BATCH_LINES = 4096
+let s:BATCH_BYTES = 65536
+
+let s:MAGIC = 0z00565042
+let s:VERSION = 1
+
+let s:OPCODE = {
+      \ 'PAPER': 0,
+      \ 'MARGIN': 1,
+      \ 'HEADER': 2,
+      \ 'NUMBER': 3,
+      \ 'LINESPACE': 4,
+      \ 'FONT': 5,
+      \ 'HIGHLIGHT': 6,
+      \ 'TEXT': 7,
+      \ 'LINE': 8,
+      \ 'START': 9,
+      \ 'END': 10,
+      \ 'HIGHDEF': 11,
+      \ 'RUN': 12,
+      \ 'SPANS': 13,
+      \ 'PAGES': 14,
+      \ 'TITLE': 15,
+      \ }
+
+let s:writer = {}
+
+function s:writer.new(outfile, opts)
+  let obj = deepcopy(self)
+  call obj.__init__(a:outfile, a:opts)
+  return obj
+endfunction
+
+function s:writer.__init__(outfile, opts)
+  let self.outfile = a:outfile
+  let self.binary = get(a:opts, 'binary', 0)
+  let self.job = v:null
+  if has_key(a:opts, 'command')
+    let self.job = job_start(a:opts.command + ['-', a:outfile], {
+          \ 'in_io': 'pipe',
+          \ 'out_io': 'null',
+          \ 'err_io': 'buffer',
+          \ 'err_name': 'print-backend',
+          \ 'err_msg': 0,
+          \ })
+    if job_status(self.job) == 'fail'
+      throw 'print: cannot start backend: ' . join(a:opts.command)
+    endif
+  endif
+  if self.binary
+    let self.out = s:MAGIC + list2blob([s:VERSION])
+  else
+    let self.out = []
+  endif
+endfunction
+
+function s:writer.command(name, ...)
+  call self.commandlist(a:name, a:000)
+endfunction
+
+" Same as command() with the arguments in a List.  Functions take at most
+" 20 arguments, so commands with a variable number of arguments use this.
+function s:writer.commandlist(name, args)
+  if self.binary
+    let self.out += list2blob([s:OPCODE[a:name]])
+    for arg in a:args
+      let self.out += s:encode(arg)
+    endfor
+  else
+    let line = a:name
+    for arg in a:args
+      let line .= ' ' . s:format(arg)
+    endfor
+    call add(self.out, line)
+  endif
+  if self.job isnot v:null
+        \ && len(self.out) >= (self.binary ? s:BATCH_BYTES : s:BATCH_LINES)
+    call self.flush()
+  endif
+endfunction
+
+function s:writer.flush()
+  if self.binary
+    call ch_sendraw(self.job, self.out)
+    let self.out = 0z
+  else
+    call ch_sendraw(self.job, join(self.out, "\n") . "\n")
+    let self.out = []
+  endif
+endfunction
+
+function s:writer.close()
+  if self.job is v:null
+    call writefile(self.out, self.outfile)
+    return
+  endif
+  call self.flush()
+  call ch_close_in(self.job)
+  while job_status(self.job) == 'run'
+    sleep 10m
+  endwhile
+  if job_info(self.job).exitval != 0
+    throw 'print: backend failed, see buffer print-backend'
+  endif
+endfunction
+
+function! s:format(arg)
+  let t = type(a:arg)
+  if t == type(0.0)
+    return printf('%f', a:arg)
+  elseif t == type(0)
+    return printf('%d', a:arg)
+  elseif t == type('')
+    return '"' . escape(s:utf8(a:arg), '"\') . '"'
+  else
+    return printf('#%02x%02x%02x', a:arg[0], a:arg[1], a:arg[2])
+  endif
+endfunction
+
+function! s:encode(arg)
+  let t = type(a:arg)
+  if t == type(0.0)
+    return list2blob(s:varint(float2nr(round(a:arg * 1000))))
+  elseif t == type(0)
+    return list2blob(s:varint(a:arg))
+  elseif t == type('')
+    let bytes = s:bytes(s:utf8(a:arg))
+    return list2blob(s:varint(len(bytes))) + bytes + 0z00
+  else
+    return list2blob(a:arg[0 : 2])
+  endif
+endfunction
+
+" zigzag encoded LEB128
+function! s:varint(n)
+  let n = a:n >= 0 ? a:n * 2 : -a:n * 2 - 1
+  let bytes = []
+  while n >= 0x80
+    call add(bytes, n % 0x80 + 0x80)
+    let n = n / 0x80
+  endwhile
+  call add(bytes, n)
+  return bytes
+endfunction
+
+" Text that iconv() cannot convert is kept as it is.
+function! s:utf8(str)
+  if &encoding ==# 'utf-8' || a:str !~ '[^\x01-\x7f]'
+    return a:str
+  endif
+  let str = iconv(a:str, &encoding, 'utf-8')
+  return str == '' ? a:str : str
+endfunction
+
+" The bytes of str as a Blob.  char2nr() of a single byte is its value,
+" also for a byte of a multibyte character.
+function! s:bytes(str)
+  if exists('*str2blob')
+    return str2blob([a:str])
+  elseif a:str !~ '[^\x01-\x7f]'
+    return list2blob(str2list(a:str))
+  endif
+  let str = a:str
+  return list2blob(map(range(len(str)), {_, i -> char2nr(str[i])}))
+endfunction
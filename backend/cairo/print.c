@@ -3,16 +3,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <cairo.h>
 #include <cairo-ps.h>
 #include <cairo-pdf.h>
+#include <cairo-svg.h>
 #include <cairo-ft.h>
+#if CAIRO_HAS_FC_FONT
+#include <fontconfig/fontconfig.h>
+#endif
+
+#include "arena.h"
+#include "lexer.h"
+#include "stats.h"
+#include "utf8.h"
 
 
 /* FIXME: don't use constant */
 #define LINENR_MARGIN 10
 
+/* Codepoints below this are cached in a flat table. */
+#define GLYPH_BMP_SIZE 0x10000
+
+/* Pages laid out ahead of the page being output, per thread. */
+#define PAGE_BATCH 8
+
+/* Index of a blank glyph that is not drawn to page files.  Only pdf and
+ * ps keep spaces, for copying text. */
+#define BLANK_GLYPH ((unsigned long)-1)
+
+/* Block sizes of the arenas.  A page block holds the records of a
+ * typical page of code. */
+#define SCRATCH_ARENA_SIZE (64 * 1024)
+#define JOB_ARENA_SIZE (64 * 1024)
+#define PAGE_ARENA_SIZE (256 * 1024)
+
+/* Synthetic variants in em: slant of italic and offset of the second
+ * strike of bold. */
+#define SYNTHETIC_SKEW 0.2
+#define SYNTHETIC_BOLD 0.04
+
+/* First line of the page cache, changed when the hash changes. */
+#define PAGE_CACHE_HEADER "pages 1"
+
 struct Options {
     double paper_width;
     double paper_height;
@@ -26,6 +68,9 @@ struct Options {
     double linespace;
     char *font_name;
     double font_size;
+    int page_first;
+    int page_last;
+    char *title;
 };
 
 
@@ -45,10 +90,113 @@ struct Highlight {
     int italic;
     int underline;
     int undercurl;
+    /* Sources created when the highlight is defined. */
+    cairo_pattern_t *fg_source;
+    cairo_pattern_t *bg_source;
+};
+
+
+struct Glyph {
+    double advance;
+    unsigned int index;
+    int blank;
+    int valid;
+};
+
+
+struct GlyphEntry {
+    unsigned long codepoint;
+    struct Glyph glyph;
+};
+
+
+/* Glyph metrics of one font variant.  Codepoints in the BMP are direct
+ * indexed, others live in an open addressing hash map. */
+struct GlyphCache {
+    struct Glyph *bmp;
+    struct GlyphEntry *map;
+    size_t map_size;
+    size_t map_count;
+};
+
+
+/* A font variant, created once per job.  A synthetic variant uses the
+ * regular face, so it shares its subset in the output, or for bold italic
+ * the face of the style the font has.  Its glyphs are filled again as
+ * outlines emboldening to the right when it is bold. */
+struct Font {
+    cairo_scaled_font_t *scaled_font;
+    double emboldening;
+    int synthetic;
+    struct GlyphCache glyphs;
+};
+
+
+#if CAIRO_HAS_FT_FONT
+/* A font file mapped for the FreeType face made from it. */
+struct FontFile {
+    FT_Face face;
+    void *data;
+    size_t size;
+};
+#endif
+
+
+/* Glyphs recorded by the layout pass.  The op shows num_glyphs glyphs
+ * of the page from glyph_start, and holds a reference to source. */
+struct Op {
+    cairo_pattern_t *source;
+    struct Font *font;
+    int glyph_start;
+    int num_glyphs;
+};
+
+
+/* A background rectangle from x0 to x1 of a row.  Adjacent rectangles of
+ * one color are merged while the row is laid out. */
+struct Fill {
+    struct Color color;
+    cairo_pattern_t *source;
+    double x0;
+    double x1;
+    double y;
+    double height;
+    int drawn;
+};
+
+
+/* A laid out page of width by height.  recording is filled by a render
+ * worker.  background
+ * is painted over the whole page, and backgrounds of that color are not
+ * recorded as fills. */
+struct Page {
+    struct Color background_color;
+    cairo_pattern_t *background;
+    struct Fill *fills;
+    int num_fills;
+    int fills_size;
+    struct Op *ops;
+    int num_ops;
+    int ops_size;
+    cairo_glyph_t *glyphs;
+    int num_glyphs;
+    int glyphs_size;
+    double width;
+    double height;
+    cairo_surface_t *recording;
+    int done;
+    /* Page number in the output, and the size of its page file. */
+    int number;
+    long bytes;
+    /* Holds fills, ops and glyphs.  A freed page keeps it for the next
+     * page on the free list. */
+    struct Arena arena;
+    struct Page *next_free;
 };
 
 
 struct PrintContext {
+    struct Page *page;
     int pagenum;
     int linenum;
     double font_height;
@@ -56,48 +204,217 @@ struct PrintContext {
     double numberwidth;
     double y;
     double x;
+    /* Advance of a fixed pitch font, 0 for other fonts, and the columns
+     * of a line. */
+    double cell;
+    int columns;
     struct Highlight hi;
 };
 
 
+/* A dump of batch mode and the file it is printed to. */
+struct Job {
+    char *infile;
+    char *outfile;
+};
+
+
+/* Shared by the batch threads.  next is the next job to take. */
+struct BatchState {
+    pthread_mutex_t mutex;
+    int next;
+    int failed;
+    int stats;
+};
+
+
+/* What the render threads take from the job that starts them, as the
+ * state of a job is per thread. */
+struct RenderJob {
+    char *outfile;
+    int page_files;
+};
+
+
 static int endswith(const char *haystack, const char *needle);
-static int utf8len(const char *str);
 static void error(const char *message, ...);
-static void skip_space();
-static int read_char();
-static char *read_command();
-static char *read_string();
-static int read_integer();
-static double read_float();
+static void fail();
 static struct Color read_color();
+static struct Highlight read_highlight();
+static int highlight_equal(const struct Highlight *a,
+        const struct Highlight *b);
+static void highlight_sources(struct Highlight *hi);
+static void highlight_free(struct Highlight *hi);
+static void default_highlight(struct Highlight *hi, const char *name);
+static char *intern_name(const char *name);
+static int name_slot(const char *name);
 static void command_paper();
 static void command_margin();
 static void command_header();
 static void command_number();
 static void command_linespace();
 static void command_font();
+static void command_pages();
+static void command_title();
 static void command_highlight();
+static void command_highdef();
+static void command_run();
 static void command_text();
 static void command_line();
 static void command_start();
 static void command_end();
+static void print_geometry();
+static void finish_output();
 static int is_white(struct Color color);
-static void set_font(const char *name, double size, int bold, int italic);
+static int same_color(struct Color a, struct Color b);
+static cairo_font_face_t *create_font_face(const char *name, int bold, int italic);
+#if CAIRO_HAS_FT_FONT
+static void font_file_destroy(void *data);
+#endif
+static struct Font *create_font(cairo_font_face_t *font_face, double size,
+        int italic, int bold, const cairo_font_options_t *font_options);
+static int has_style(struct Font *font, int bold, int italic);
+static cairo_font_options_t *create_font_options();
+static void load_fonts(const char *name, double size,
+        const cairo_font_options_t *font_options);
+static void free_font(struct Font *font);
+static void free_fonts();
+static void report_fonts();
+static const char *find_bytes(const char *p, const char *end,
+        const char *s);
+static long embedded_font_size(const char *path);
+static unsigned long glyph_count(struct GlyphCache *cache);
+static struct Font *get_font(int bold, int italic);
+static struct Glyph *glyph_cache_map_slot(struct GlyphCache *cache,
+        unsigned long codepoint);
+static const struct Glyph *lookup_glyph(struct Font *font,
+        unsigned long codepoint);
+static void map_glyphs(struct Font *font, const uint32_t *codepoints,
+        int num_glyphs, cairo_glyph_t *glyphs);
+static double text_width(struct Font *font, const char *text);
+static int exact_grid(double x);
+static void monospace_layout();
+static int grid_column(double x);
+static struct Page *page_create();
+static void page_clear(struct Page *page);
+static void page_free(struct Page *page);
+static struct Op *page_add_op(struct Page *page);
+static void page_add_fill(struct Page *page, const struct Highlight *hi,
+        double x0, double x1, double y, double height);
+static void finish_page();
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+static uint64_t page_hash(struct Page *page);
+static int page_changed(struct Page *page);
+static void load_page_cache();
+static void save_page_cache();
+static void draw_page(cairo_t *cr, struct Page *page);
+static void write_page(struct Page *page, int pagenum);
+static void raster_page(struct Page *page, const char *path);
+static void svg_page(struct Page *page, const char *path);
+static char *page_path(int pagenum);
+static void remove_page_files(int pagenum);
+static void write_ppm(cairo_surface_t *image, const char *path);
+static void *render_worker(void *arg);
+static void start_render();
+static void stop_render();
+static void queue_page(struct Page *page);
+static void output_page(struct Page *page);
+static void output_done(int keep);
+static void draw_pages();
+static int page_in_range(int pagenum);
 static void newline();
 static void newpage();
 static void print_number();
 static void print_header();
-static void print_text(const char *text, struct Highlight hi);
-static void print();
-
-
-static char *infile;
-static char *outfile;
-static FILE *in;
-static struct Options options;
-static struct PrintContext pc;
-static cairo_surface_t *surface;
-static cairo_t *cr;
+static void print_glyphs(struct Font *font, cairo_glyph_t *glyphs,
+        int num_glyphs, double x, const struct Highlight *hi);
+static int print_columns(struct Font *font, const char *text, size_t len,
+        int col, const struct Highlight *hi);
+static void print_text(const char *text, const struct Highlight *hi);
+static int print();
+static void add_job(const char *infile, const char *outfile);
+static void read_manifest(const char *path);
+static void read_directory(const char *path);
+static int compare_jobs(const void *a, const void *b);
+static int compare_outfiles(const void *a, const void *b);
+static void run_job(struct Job *job);
+static void reset_job();
+static int try_job(struct Job *job);
+static void abort_job();
+static void *batch_worker(void *arg);
+static int batch(const char *path);
+
+
+static int threads;
+static int verbose;
+static int stats_json;
+static int geometry;
+static int page_cache;
+static double dpi = 96;
+/* The state of a job.  Batch mode prints jobs on threads side by side,
+ * so each thread has its own. */
+static __thread char *infile;
+static __thread char *outfile;
+static __thread struct Lexer lexer;
+static __thread struct Options options;
+static __thread struct PrintContext pc;
+static __thread cairo_surface_t *surface;
+static __thread cairo_t *cr;
+static __thread struct Font *fonts[2][2];
+static __thread char *fonts_name;
+static __thread double fonts_size;
+static __thread cairo_font_options_t *fonts_options;
+static __thread struct Highlight *highlights;
+static __thread int highlights_size;
+/* Highlight names of the job, each kept once in the job arena, in an open
+ * addressed table of names_size slots. */
+static __thread char **names;
+static __thread int names_size;
+static __thread int num_names;
+static __thread struct Highlight linenr_highlight;
+static __thread struct Highlight header_highlight;
+static __thread struct Color foreground = {0, 0, 0};
+static __thread struct Color background = {1, 1, 1};
+static __thread cairo_pattern_t *background_source;
+static __thread int page_files;
+/* Hashes of the pages of the last run, read from outfile.pages with
+ * --cache, and of the pages of this run. */
+static __thread uint64_t *cached_hashes;
+static __thread int num_cached_hashes;
+static __thread uint64_t *page_hashes;
+static __thread int page_hashes_size;
+static __thread int output_pages;
+static __thread int document_start;
+static __thread struct Page *free_pages;
+/* Memory of one command, of a job and its documents.  Fonts outlive jobs
+ * in batch mode, so they are not in the job arena. */
+static __thread struct Arena scratch_arena;
+static __thread struct Arena job_arena;
+/* Where error() gives up the job of a batch thread, NULL elsewhere. */
+static __thread jmp_buf *job_failed;
+static struct Job *jobs;
+static int num_jobs;
+static int jobs_size;
+/* Pages queued for the render threads in a ring of queue_size.  Pages
+ * from queue_head are output in order by the main thread, the threads
+ * take pages from render_next, and new pages go to queue_tail. */
+static pthread_t *render_threads;
+static int num_render_threads;
+static struct Page **queue;
+static int queue_size;
+static long queue_head;
+static long queue_tail;
+static long render_next;
+static int render_quit;
+static struct RenderJob render_job;
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a page is done, and when a page is queued or the threads
+ * are to quit. */
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+#if CAIRO_HAS_FT_FONT
+static pthread_mutex_t ft_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 
 static int
@@ -116,238 +433,341 @@ endswith(const char *haystack, const char *needle)
 }
 
 
-static int
-utf8len(const char *str)
-{
-    unsigned char c;
-
-    c = (unsigned char)str[0];
-    if ((c & 0x80) == 0) {
-        return 1;
-    } else if ((c & 0xE0) == 0xC0) {
-        return 2;
-    } else if ((c & 0xF0) == 0xE0) {
-        return 3;
-    } else if ((c & 0xF8) == 0xF0) {
-        return 4;
-    } else if ((c & 0xFC) == 0xF8) {
-        return 5;
-    } else if ((c & 0xFE) == 0xFC) {
-        return 6;
-    }
-
-    error("invalid utf8");
-}
-
-
 static void
 error(const char *format, ...)
 {
     va_list ap;
 
+    flockfile(stderr);
     va_start(ap, format);
     vfprintf(stderr, format, ap);
     fprintf(stderr, "\n");
     va_end(ap);
+    funlockfile(stderr);
 
-    exit(EXIT_FAILURE);
+    fail();
 }
 
 
+/* A job of a batch thread gives up alone, and the thread goes on with the
+ * next job.  Elsewhere an error ends the process. */
 static void
-skip_space()
+fail()
 {
-    fscanf(in, "%*[ \t\r\n]");
+    if (job_failed != NULL) {
+        longjmp(*job_failed, 1);
+    }
+    exit(EXIT_FAILURE);
 }
 
 
-static int
-read_char()
+static struct Color
+read_color()
 {
-    int c;
+    unsigned long rgb;
+    struct Color color;
 
-    c = fgetc(in);
-    if (c == EOF) {
-        error("unexpected EOF");
-    }
+    rgb = lexer_color(&lexer);
 
-    return c;
+    color.r = ((rgb >> 16) & 0xFF) / 255.0;
+    color.g = ((rgb >> 8) & 0xFF) / 255.0;
+    color.b = (rgb & 0xFF) / 255.0;
+
+    return color;
 }
 
 
-static char *
-read_command()
+static void
+command_paper()
 {
-    char buf[256];
-    int n;
+    options.paper_width = lexer_float(&lexer);
+    options.paper_height = lexer_float(&lexer);
+}
 
-    n = fscanf(in, "%s", buf);
-    if (n != 1) {
-        error("read_command error");
-    }
 
-    return strdup(buf);
+static void
+command_margin()
+{
+    options.margin_left = lexer_float(&lexer);
+    options.margin_top = lexer_float(&lexer);
+    options.margin_right = lexer_float(&lexer);
+    options.margin_bottom = lexer_float(&lexer);
 }
 
 
-static char *
-read_string()
+static void
+command_header()
 {
-    int c;
-    char *buf = NULL;
-    size_t bufsize = 0;
-
-    skip_space();
-    c = read_char();
-    if (c != '"') {
-        error("unexpected character: %d", c);
-    }
+    options.header_format = arena_strdup(&job_arena, lexer_string(&lexer));
+    options.header_extraline = lexer_integer(&lexer);
+}
 
-    for (;;) {
-        bufsize += 1;
-        buf = realloc(buf, bufsize);
-        c = read_char();
-        if (c == '"') {
-            buf[bufsize - 1] = '\0';
-            break;
-        }
-        if (c == '\\') {
-            c = read_char();
-        }
-        buf[bufsize - 1] = c;
-    }
 
-    return buf;
+static void
+command_number()
+{
+    options.number_width = lexer_integer(&lexer);
 }
 
 
-static int
-read_integer()
+static void
+command_linespace()
 {
-    int n;
-    int x;
+    options.linespace = lexer_float(&lexer);
+}
 
-    n = fscanf(in, "%d", &x);
-    if (n != 1) {
-        error("read_integer error");
-    }
 
-    return x;
+static void
+command_font()
+{
+    options.font_name = arena_strdup(&job_arena, lexer_string(&lexer));
+    options.font_size = lexer_float(&lexer);
 }
 
 
-static double
-read_float()
+/* PAGES first last
+ * Only pages first to last are printed.  last 0 is the last page. */
+static void
+command_pages()
 {
-    int n;
-    double x;
-
-    n = fscanf(in, "%lf", &x);
-    if (n != 1) {
-        error("read_float error");
+    options.page_first = lexer_integer(&lexer);
+    options.page_last = lexer_integer(&lexer);
+    if (options.page_first < 1 || options.page_last < 0
+            || (options.page_last != 0
+                && options.page_last < options.page_first)) {
+        error("invalid page range: %d %d",
+                options.page_first, options.page_last);
     }
-
-    return x;
 }
 
-
-static struct Color
-read_color()
+/* TITLE title
+ * The outline entry of the document in a pdf. */
+static void
+command_title()
 {
-    int n;
-    int r, g, b;
-    struct Color color;
+    options.title = arena_strdup(&job_arena, lexer_string(&lexer));
+}
 
-    skip_space();
-    n = fscanf(in, "#%2x%2x%2x", &r, &g, &b);
-    if (n != 3) {
-        error("read_color error");
-    }
 
-    color.r = r / 255.0;
-    color.g = g / 255.0;
-    color.b = b / 255.0;
+/* The name is in the scratch arena.  A highlight that is kept moves it to
+ * the job arena. */
+static struct Highlight
+read_highlight()
+{
+    struct Highlight hi;
 
-    return color;
+    hi.name = arena_strdup(&scratch_arena, lexer_string(&lexer));
+    hi.fg = read_color();
+    hi.bg = read_color();
+    hi.sp = read_color();
+    hi.bold = lexer_integer(&lexer);
+    hi.italic = lexer_integer(&lexer);
+    hi.underline = lexer_integer(&lexer);
+    hi.undercurl = lexer_integer(&lexer);
+    hi.fg_source = NULL;
+    hi.bg_source = NULL;
+
+    return hi;
 }
 
 
-static void
-command_paper()
+static int
+highlight_equal(const struct Highlight *a, const struct Highlight *b)
 {
-    options.paper_width = read_float();
-    options.paper_height = read_float();
+    return strcmp(a->name, b->name) == 0
+        && memcmp(&a->fg, &b->fg, sizeof(a->fg)) == 0
+        && memcmp(&a->bg, &b->bg, sizeof(a->bg)) == 0
+        && memcmp(&a->sp, &b->sp, sizeof(a->sp)) == 0
+        && a->bold == b->bold
+        && a->italic == b->italic
+        && a->underline == b->underline
+        && a->undercurl == b->undercurl;
 }
 
 
 static void
-command_margin()
+highlight_sources(struct Highlight *hi)
 {
-    options.margin_left = read_float();
-    options.margin_top = read_float();
-    options.margin_right = read_float();
-    options.margin_bottom = read_float();
+    hi->fg_source = cairo_pattern_create_rgb(hi->fg.r, hi->fg.g, hi->fg.b);
+    hi->bg_source = cairo_pattern_create_rgb(hi->bg.r, hi->bg.g, hi->bg.b);
 }
 
 
+/* The name is given back with the job arena. */
 static void
-command_header()
+highlight_free(struct Highlight *hi)
 {
-    options.header_format = read_string();
-    options.header_extraline = read_integer();
+    hi->name = NULL;
+    if (hi->fg_source != NULL) {
+        cairo_pattern_destroy(hi->fg_source);
+        hi->fg_source = NULL;
+    }
+    if (hi->bg_source != NULL) {
+        cairo_pattern_destroy(hi->bg_source);
+        hi->bg_source = NULL;
+    }
 }
 
 
+/* FIXME: load from file */
 static void
-command_number()
+default_highlight(struct Highlight *hi, const char *name)
 {
-    options.number_width = read_integer();
+    hi->name = intern_name(name);
+    hi->fg = foreground;
+    hi->bg = background;
+    hi->sp = hi->fg;
+    hi->bold = 0;
+    hi->italic = 0;
+    hi->underline = 0;
+    hi->undercurl = 0;
+    highlight_sources(hi);
 }
 
 
-static void
-command_linespace()
+/* The copy of name that outlives the command.  A HIGHLIGHT per change of
+ * highlight names the same few groups again and again, so the job arena
+ * only grows with the number of groups. */
+static char *
+intern_name(const char *name)
 {
-    options.linespace = read_float();
+    char **old;
+    int old_size;
+    int i;
+
+    if (2 * (num_names + 1) > names_size) {
+        old = names;
+        old_size = names_size;
+        names_size = (names_size == 0) ? 64 : names_size * 2;
+        names = calloc(names_size, sizeof(char *));
+        if (names == NULL) {
+            error("out of memory");
+        }
+        for (i = 0; i < old_size; ++i) {
+            if (old[i] != NULL) {
+                names[name_slot(old[i])] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    i = name_slot(name);
+    if (names[i] == NULL) {
+        names[i] = arena_strdup(&job_arena, name);
+        num_names += 1;
+    }
+    return names[i];
 }
 
 
-static void
-command_font()
+/* The slot of name in names, or the empty slot it goes to. */
+static int
+name_slot(const char *name)
 {
-    options.font_name = read_string();
-    options.font_size = read_float();
+    uint64_t mask = names_size - 1;
+    uint64_t i;
+
+    i = hash_bytes(0xcbf29ce484222325ULL, name, strlen(name)) & mask;
+    while (names[i] != NULL && strcmp(names[i], name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return (int)i;
 }
 
+
+/* HIGHLIGHT is repeated for every run, so the sources are only created
+ * when it differs from the previous one.  HIGHDEF and RUN avoid this. */
 static void
 command_highlight()
 {
     struct Highlight hi;
 
-    hi.name = read_string();
-    hi.fg = read_color();
-    hi.bg = read_color();
-    hi.sp = read_color();
-    hi.bold = read_integer();
-    hi.italic = read_integer();
-    hi.underline = read_integer();
-    hi.undercurl = read_integer();
+    hi = read_highlight();
+
+    if (pc.hi.name != NULL && highlight_equal(&hi, &pc.hi)) {
+        return;
+    }
 
+    hi.name = intern_name(hi.name);
+    highlight_sources(&hi);
     if (pc.hi.name != NULL) {
-        free(pc.hi.name);
+        highlight_free(&pc.hi);
     }
     pc.hi = hi;
 }
 
 
 static void
-command_text()
+command_highdef()
+{
+    int id;
+    int size;
+
+    id = lexer_integer(&lexer);
+    if (id < 0) {
+        error("invalid highlight id: %d", id);
+    }
+
+    if (id >= highlights_size) {
+        size = (highlights_size == 0) ? 256 : highlights_size;
+        while (size <= id) {
+            size *= 2;
+        }
+        highlights = realloc(highlights, size * sizeof(struct Highlight));
+        if (highlights == NULL) {
+            error("out of memory");
+        }
+        memset(highlights + highlights_size, 0,
+                (size - highlights_size) * sizeof(struct Highlight));
+        highlights_size = size;
+    }
+
+    if (highlights[id].name != NULL) {
+        highlight_free(&highlights[id]);
+    }
+    highlights[id] = read_highlight();
+    highlights[id].name = intern_name(highlights[id].name);
+    highlight_sources(&highlights[id]);
+
+    /* Normal gives the colors of the page. */
+    if (strcmp(highlights[id].name, "Normal") == 0) {
+        foreground = highlights[id].fg;
+        background = highlights[id].bg;
+        if (background_source != NULL) {
+            cairo_pattern_destroy(background_source);
+            background_source = NULL;
+        }
+        if (!is_white(background)) {
+            background_source =
+                cairo_pattern_reference(highlights[id].bg_source);
+        }
+    }
+}
+
+
+static void
+command_run()
 {
-    char *text;
+    int id;
+
+    id = lexer_integer(&lexer);
+    if (id < 0 || id >= highlights_size || highlights[id].name == NULL) {
+        error("undefined highlight id: %d", id);
+    }
+
+    STATS_ADD(COUNTER_RUNS, 1);
+    print_text(lexer_string(&lexer), &highlights[id]);
+}
+
 
-    text = read_string();
-    print_text(text, pc.hi);
-    free(text);
+static void
+command_text()
+{
+    if (pc.hi.name == NULL) {
+        error("TEXT without HIGHLIGHT");
+    }
+    STATS_ADD(COUNTER_RUNS, 1);
+    print_text(lexer_string(&lexer), &pc.hi);
 }
 
 
@@ -361,46 +781,150 @@ command_line()
 static void
 command_start()
 {
+    cairo_font_options_t *font_options;
     cairo_font_extents_t fe;
-    cairo_text_extents_t te;
-
-    if (endswith(outfile, ".ps")) {
-        surface = cairo_ps_surface_create(outfile,
-                options.paper_width, options.paper_height);
-    } else if (endswith(outfile, ".pdf")) {
-        surface = cairo_pdf_surface_create(outfile,
+    enum Phase prev;
+
+    /* Images and svg are written per page by draw_pages().  Documents
+     * after the first one go on in the same output. */
+    page_files = !geometry && (endswith(outfile, ".png")
+            || endswith(outfile, ".ppm") || endswith(outfile, ".svg"));
+    if (page_files || geometry) {
+        /* no surface */
+    } else if (surface == NULL) {
+        if (endswith(outfile, ".ps")) {
+            surface = cairo_ps_surface_create(outfile,
+                    options.paper_width, options.paper_height);
+        } else if (endswith(outfile, ".pdf")) {
+            surface = cairo_pdf_surface_create(outfile,
+                    options.paper_width, options.paper_height);
+        } else {
+            error("file type is not supported: %s", outfile);
+        }
+        cr = cairo_create(surface);
+    } else if (endswith(outfile, ".ps")) {
+        cairo_ps_surface_set_size(surface,
                 options.paper_width, options.paper_height);
     } else {
-        error("file type is not supported: %s", outfile);
+        cairo_pdf_surface_set_size(surface,
+                options.paper_width, options.paper_height);
     }
+    document_start = output_pages;
 
-    cr = cairo_create(surface);
-
+    pc.page = page_create();
     pc.pagenum = 0;
     pc.linenum = 0;
 
-    set_font(options.font_name, options.font_size, 0, 0);
+    /* Fonts are kept for the next document using the same font with the
+     * same options.  Batch jobs of other output types get other
+     * options. */
+    font_options = create_font_options();
+    if (fonts_name == NULL || strcmp(fonts_name, options.font_name) != 0
+            || fonts_size != options.font_size
+            || !cairo_font_options_equal(fonts_options, font_options)) {
+        prev = STATS_PHASE(PHASE_MEASURE);
+        free_fonts();
+        load_fonts(options.font_name, options.font_size, font_options);
+        STATS_PHASE(prev);
+        fonts_name = strdup(options.font_name);
+        fonts_size = options.font_size;
+        fonts_options = font_options;
+    } else {
+        cairo_font_options_destroy(font_options);
+    }
+
+    default_highlight(&linenr_highlight, "LineNr");
+    default_highlight(&header_highlight, "PageHeader");
 
     /* FIXME: How to get line height and baseline offset?
      * Use linespace option for workaround. */
-    cairo_font_extents(cr, &fe);
+    cairo_scaled_font_extents(get_font(0, 0)->scaled_font, &fe);
     pc.font_height = fe.height + options.linespace;
     pc.font_descent = fe.descent + options.linespace / 2;
 
     if (options.number_width > 0) {
         /* FIXME: What is correct way? */
-        cairo_text_extents(cr, "0", &te);
-        pc.numberwidth = options.number_width * te.x_advance + LINENR_MARGIN;
+        pc.numberwidth = options.number_width * text_width(get_font(0, 0), "0")
+            + LINENR_MARGIN;
     } else {
         pc.numberwidth = 0;
     }
+
+    monospace_layout();
+    if (verbose && pc.cell > 0) {
+        fprintf(stderr, "fixed pitch: %g pt, %d columns\n",
+                pc.cell, pc.columns);
+    }
+}
+
+
+/* Print the rows of a page and the columns of a fixed pitch font, 0 for
+ * other fonts, as newline() and print_text() lay them out.  A dumper uses
+ * them to find the lines of a page range. */
+static void
+print_geometry()
+{
+    double limit = options.paper_height - options.margin_bottom;
+    double y;
+    int rows = 1;
+
+    y = options.margin_top + pc.font_height * (1 + options.header_extraline);
+    for (y += pc.font_height; y + pc.font_height <= limit;
+            y += pc.font_height) {
+        rows += 1;
+    }
+    printf("%d %d\n", rows, pc.columns);
 }
 
 
+/* A document has its own page numbers.  The output is finished by
+ * finish_output() when the input ends. */
 static void
 command_end()
 {
-    cairo_show_page(cr);
+    finish_page();
+    draw_pages();
+    page_free(pc.page);
+    pc.page = NULL;
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 16, 0)
+    if (options.title != NULL && output_pages > document_start
+            && endswith(outfile, ".pdf")) {
+        char link[32];
+
+        sprintf(link, "page=%d", document_start + 1);
+        cairo_pdf_surface_add_outline(surface, CAIRO_PDF_OUTLINE_ROOT,
+                options.title, link, 0);
+    }
+#endif
+
+    /* The next document names its own title and pages. */
+    options.title = NULL;
+    options.page_first = 0;
+    options.page_last = 0;
+
+    if (verbose) {
+        report_fonts();
+    }
+    highlight_free(&linenr_highlight);
+    highlight_free(&header_highlight);
+}
+
+
+static void
+finish_output()
+{
+    struct stat st;
+    enum Phase prev;
+
+    stop_render();
+
+    if (page_files) {
+        remove_page_files(output_pages + 1);
+    }
+    if (page_cache) {
+        save_page_cache();
+    }
 
     if (cr != NULL) {
         cairo_destroy(cr);
@@ -408,82 +932,1432 @@ command_end()
     }
 
     if (surface != NULL) {
+        prev = STATS_PHASE(PHASE_FINISH);
         cairo_surface_finish(surface);
         cairo_surface_destroy(surface);
         surface = NULL;
+        STATS_PHASE(prev);
+
+        if (stat(outfile, &st) == 0) {
+            STATS_ADD(COUNTER_BYTES, st.st_size);
+            if (verbose) {
+                fprintf(stderr, "%s: %ld bytes, %ld bytes of fonts\n",
+                        outfile, (long)st.st_size,
+                        embedded_font_size(outfile));
+            }
+        }
     }
+    output_pages = 0;
 }
 
 
-static int
-is_white(struct Color color)
-{
-    return (color.r == 1 && color.g == 1 && color.b == 1);
-}
-
-
+/* outfile.pages holds the hash of each page file written last time.  A
+ * missing or broken cache keeps no page. */
 static void
-set_font(const char *name, double size, int bold, int italic)
+load_page_cache()
 {
-    cairo_font_slant_t slant;
-    cairo_font_weight_t weight;
-
-    if (italic) {
-        slant = CAIRO_FONT_SLANT_ITALIC;
-    } else {
-        slant = CAIRO_FONT_SLANT_NORMAL;
+    char line[64];
+    char *path;
+    FILE *fp;
+    int size = 0;
+
+    num_cached_hashes = 0;
+    path = malloc(strlen(outfile) + 7);
+    if (path == NULL) {
+        error("out of memory");
     }
-
-    if (bold) {
-        weight = CAIRO_FONT_WEIGHT_BOLD;
-    } else {
-        weight = CAIRO_FONT_WEIGHT_NORMAL;
+    sprintf(path, "%s.pages", outfile);
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL) {
+        return;
     }
 
-    if (endswith(name, ".ttf")) {
-#if CAIRO_HAS_FT_FONT
-        /* FIXME: bold? italic? */
-        static char prev_name[512] = {0};
-        static FT_Library library = NULL;
-        FT_Face face;
-        FT_Error err;
-        cairo_font_face_t *f;
-        int face_index = 0;
-        int load_flags = 0;
-
-        if (strcmp(prev_name, name) != 0) {
-            if (library != NULL) {
-                err = FT_Init_FreeType(&library);
-                if (err) {
-                    error("FT_Init_FreeType failed");
+    if (fgets(line, sizeof(line), fp) != NULL
+            && strcmp(line, PAGE_CACHE_HEADER "\n") == 0) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (num_cached_hashes == size) {
+                size = (size == 0) ? 64 : size * 2;
+                cached_hashes = realloc(cached_hashes,
+                        size * sizeof(uint64_t));
+                if (cached_hashes == NULL) {
+                    error("out of memory");
                 }
             }
-
-            err = FT_New_Face(library, name, face_index, &face);
-            if (err) {
-                error("FT_New_Face failed");
-            }
-
-            f = cairo_ft_font_face_create_for_ft_face(face, load_flags);
-
-            cairo_set_font_face(cr, f);
+            cached_hashes[num_cached_hashes++] = strtoull(line, NULL, 16);
         }
-
-        cairo_set_font_size(cr, size);
-#else
-        error("ttf is not supported");
-#endif
-    } else {
-        /* FIXME: How to embed? */
-        cairo_select_font_face(cr, name, slant, weight);
-        cairo_set_font_size(cr, size);
     }
+    fclose(fp);
+}
+
+
+/* Only page files are kept, so other outputs leave no cache. */
+static void
+save_page_cache()
+{
+    char *path;
+    FILE *fp;
+    int i;
+
+    path = malloc(strlen(outfile) + 7);
+    if (path == NULL) {
+        error("out of memory");
+    }
+    sprintf(path, "%s.pages", outfile);
+    if (page_files && output_pages > 0) {
+        fp = fopen(path, "w");
+        if (fp == NULL) {
+            error("cannot write: %s", path);
+        }
+        fprintf(fp, "%s\n", PAGE_CACHE_HEADER);
+        for (i = 0; i < output_pages; ++i) {
+            fprintf(fp, "%016llx\n", (unsigned long long)page_hashes[i]);
+        }
+        fclose(fp);
+    }
+    free(path);
+
+    free(cached_hashes);
+    cached_hashes = NULL;
+    num_cached_hashes = 0;
+}
+
+
+static int
+is_white(struct Color color)
+{
+    return (color.r == 1 && color.g == 1 && color.b == 1);
+}
+
+
+static int
+same_color(struct Color a, struct Color b)
+{
+    return (a.r == b.r && a.g == b.g && a.b == b.b);
+}
+
+
+static cairo_font_face_t *
+create_font_face(const char *name, int bold, int italic)
+{
+    cairo_font_slant_t slant;
+    cairo_font_weight_t weight;
+
+    if (endswith(name, ".ttf")) {
+#if CAIRO_HAS_FT_FONT
+        static FT_Library library = NULL;
+        static const cairo_user_data_key_t key;
+        struct FontFile *file;
+        struct stat st;
+        FT_Error err;
+        cairo_font_face_t *f;
+        int face_index = 0;
+        int load_flags = 0;
+        int fd;
+
+        /* Faces of the library are made and done one at a time, as
+         * batch threads share it. */
+        pthread_mutex_lock(&ft_mutex);
+        if (library == NULL) {
+            err = FT_Init_FreeType(&library);
+            if (err) {
+                pthread_mutex_unlock(&ft_mutex);
+                error("FT_Init_FreeType failed");
+            }
+        }
+        pthread_mutex_unlock(&ft_mutex);
+
+        file = malloc(sizeof(struct FontFile));
+        if (file == NULL) {
+            error("out of memory");
+        }
+
+        fd = open(name, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            error("cannot open font: %s", name);
+        }
+        file->size = st.st_size;
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) {
+            error("cannot map font: %s", name);
+        }
+        close(fd);
+
+        pthread_mutex_lock(&ft_mutex);
+        err = FT_New_Memory_Face(library, file->data, file->size,
+                face_index, &file->face);
+        pthread_mutex_unlock(&ft_mutex);
+        if (err) {
+            error("FT_New_Memory_Face failed");
+        }
+
+        f = cairo_ft_font_face_create_for_ft_face(file->face, load_flags);
+
+        /* The mapping and FT_Face have to live as long as the font face. */
+        if (cairo_font_face_set_user_data(f, &key, file, font_file_destroy)
+                != CAIRO_STATUS_SUCCESS) {
+            error("cairo_font_face_set_user_data failed");
+        }
+
+        return f;
+#else
+        error("ttf is not supported");
+#endif
+    }
+
+    if (italic) {
+        slant = CAIRO_FONT_SLANT_ITALIC;
+    } else {
+        slant = CAIRO_FONT_SLANT_NORMAL;
+    }
+
+    if (bold) {
+        weight = CAIRO_FONT_WEIGHT_BOLD;
+    } else {
+        weight = CAIRO_FONT_WEIGHT_NORMAL;
+    }
+
+    /* FIXME: How to embed? */
+    return cairo_toy_font_face_create(name, slant, weight);
+}
+
+
+#if CAIRO_HAS_FT_FONT
+static void
+font_file_destroy(void *data)
+{
+    struct FontFile *file = data;
+
+    pthread_mutex_lock(&ft_mutex);
+    FT_Done_Face(file->face);
+    pthread_mutex_unlock(&ft_mutex);
+    munmap(file->data, file->size);
+    free(file);
+}
+#endif
+
+
+/* italic slants and bold emboldens font_face synthetically. */
+static struct Font *
+create_font(cairo_font_face_t *font_face, double size, int italic, int bold,
+        const cairo_font_options_t *font_options)
+{
+    cairo_matrix_t font_matrix;
+    cairo_matrix_t ctm;
+    struct Font *font;
+
+    font = calloc(1, sizeof(struct Font));
+    if (font == NULL) {
+        error("out of memory");
+    }
+
+    cairo_matrix_init(&font_matrix, size, 0,
+            italic ? -SYNTHETIC_SKEW * size : 0, size, 0, 0);
+    cairo_matrix_init_identity(&ctm);
+    font->scaled_font = cairo_scaled_font_create(font_face,
+            &font_matrix, &ctm, font_options);
+    font->emboldening = bold ? SYNTHETIC_BOLD * size : 0;
+    font->synthetic = italic || bold;
+
+    return font;
+}
+
+
+/* Whether the face behind font is really bold and italic.  fontconfig
+ * falls back to the regular face and lets cairo fake the style, which
+ * embeds the variant as another font. */
+static int
+has_style(struct Font *font, int bold, int italic)
+{
+#if CAIRO_HAS_FT_FONT
+    FT_Face face;
+    int ok = 1;
+
+    if (cairo_scaled_font_get_type(font->scaled_font) != CAIRO_FONT_TYPE_FT) {
+        return 1;
+    }
+    face = cairo_ft_scaled_font_lock_face(font->scaled_font);
+    if (face == NULL) {
+        return 1;
+    }
+    if (bold && !(face->style_flags & FT_STYLE_FLAG_BOLD)) {
+        ok = 0;
+    }
+    if (italic && !(face->style_flags & FT_STYLE_FLAG_ITALIC)) {
+        ok = 0;
+    }
+    cairo_ft_scaled_font_unlock_face(font->scaled_font);
+    return ok;
+#else
+    return 1;
+#endif
+}
+
+
+/* Options of the scaled fonts for the output.  Page files are laid out
+ * with the metrics of pdf output. */
+static cairo_font_options_t *
+create_font_options()
+{
+    cairo_font_options_t *font_options;
+
+    font_options = cairo_font_options_create();
+    if (surface != NULL) {
+        cairo_surface_get_font_options(surface, font_options);
+    } else {
+        cairo_font_options_set_hint_style(font_options, CAIRO_HINT_STYLE_NONE);
+        cairo_font_options_set_hint_metrics(font_options,
+                CAIRO_HINT_METRICS_OFF);
+    }
+    return font_options;
+}
+
+
+/* Create the scaled font of every bold/italic variant.  They are kept
+ * until command_end(), so switching highlights only switches pointers.
+ * A variant the font does not have is synthesized from the regular face.
+ * Bold italic is synthesized from the bold or the italic face when the
+ * font has one of them, so only the missing style is faked.  A ttf file
+ * has a single face, so all its variants are synthetic. */
+static void
+load_fonts(const char *name, double size,
+        const cairo_font_options_t *font_options)
+{
+    cairo_font_face_t *regular;
+    cairo_font_face_t *font_face;
+    struct Font *font;
+    int bold;
+    int italic;
+
+    regular = create_font_face(name, 0, 0);
+
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            font = NULL;
+            if (!bold && !italic) {
+                font = create_font(regular, size, 0, 0, font_options);
+            } else if (!endswith(name, ".ttf")) {
+                font_face = create_font_face(name, bold, italic);
+                font = create_font(font_face, size, 0, 0, font_options);
+                cairo_font_face_destroy(font_face);
+                if (cairo_scaled_font_status(font->scaled_font)
+                        == CAIRO_STATUS_SUCCESS
+                        && !has_style(font, bold, italic)) {
+                    free_font(font);
+                    font = NULL;
+                }
+            }
+            if (font == NULL && bold && italic) {
+                if (!fonts[1][0]->synthetic) {
+                    font = create_font(cairo_scaled_font_get_font_face(
+                                fonts[1][0]->scaled_font),
+                            size, 1, 0, font_options);
+                } else if (!fonts[0][1]->synthetic) {
+                    font = create_font(cairo_scaled_font_get_font_face(
+                                fonts[0][1]->scaled_font),
+                            size, 0, 1, font_options);
+                }
+            }
+            if (font == NULL) {
+                font = create_font(regular, size, italic, bold, font_options);
+            }
+
+            if (cairo_scaled_font_status(font->scaled_font)
+                    != CAIRO_STATUS_SUCCESS) {
+                error("cannot load font: %s", name);
+            }
+
+            fonts[bold][italic] = font;
+        }
+    }
+
+    cairo_font_face_destroy(regular);
+}
+
+
+static void
+free_font(struct Font *font)
+{
+    cairo_scaled_font_destroy(font->scaled_font);
+    free(font->glyphs.bmp);
+    free(font->glyphs.map);
+    free(font);
+}
+
+
+static void
+free_fonts()
+{
+    int bold;
+    int italic;
+
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            if (fonts[bold][italic] != NULL) {
+                free_font(fonts[bold][italic]);
+                fonts[bold][italic] = NULL;
+            }
+        }
+    }
+    free(fonts_name);
+    fonts_name = NULL;
+    if (fonts_options != NULL) {
+        cairo_font_options_destroy(fonts_options);
+        fonts_options = NULL;
+    }
+}
+
+
+static unsigned long
+glyph_count(struct GlyphCache *cache)
+{
+    unsigned long count;
+    size_t i;
+
+    count = cache->map_count;
+    if (cache->bmp != NULL) {
+        for (i = 0; i < GLYPH_BMP_SIZE; ++i) {
+            count += cache->bmp[i].valid;
+        }
+    }
+    return count;
+}
+
+
+/* The subset of a font embeds the glyphs used by its variants.  Fonts
+ * are kept between documents, so the counts add up. */
+static void
+report_fonts()
+{
+    struct Font *font;
+    int bold;
+    int italic;
+
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            font = fonts[bold][italic];
+            fprintf(stderr, "font %s%s%s: %lu glyphs%s\n",
+                    options.font_name,
+                    bold ? " bold" : "",
+                    italic ? " italic" : "",
+                    glyph_count(&font->glyphs),
+                    font->synthetic ? ", synthetic" : "");
+        }
+    }
+}
+
+
+static const char *
+find_bytes(const char *p, const char *end, const char *s)
+{
+    size_t len = strlen(s);
+
+    while ((size_t)(end - p) >= len) {
+        p = memchr(p, s[0], end - p - len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p, s, len) == 0) {
+            return p;
+        }
+        p += 1;
+    }
+    return NULL;
+}
+
+
+/* Bytes of the font programs embedded in the finished output at path, or
+ * -1 when it is not a pdf or ps.  cairo does not tell them, so they are
+ * read back: in a pdf the streams whose dictionary has the keys of a font
+ * file, in a ps the font resources. */
+static long
+embedded_font_size(const char *path)
+{
+    static const char *const font_keys[] = {
+        "/Length1", "/Type1C", "/CIDFontType0C", "/OpenType", NULL
+    };
+    struct stat st;
+    const char *data;
+    const char *end;
+    const char *p;
+    const char *q;
+    const char *dict;
+    long size = 0;
+    int pdf;
+    int fd;
+    int i;
+
+    pdf = endswith(path, ".pdf");
+    if (!pdf && !endswith(path, ".ps")) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    end = data + st.st_size;
+
+    if (pdf) {
+        for (p = data; (p = find_bytes(p, end, "stream")) != NULL; p = q) {
+            q = p + 6;
+            if (p - data >= 3 && memcmp(p - 3, "end", 3) == 0) {
+                continue;
+            }
+            /* The dictionary follows the "obj" of the stream. */
+            for (dict = p; dict > data && memcmp(dict, "obj", 3) != 0;
+                    --dict) {
+            }
+            for (i = 0; font_keys[i] != NULL; ++i) {
+                if (find_bytes(dict, p, font_keys[i]) != NULL) {
+                    break;
+                }
+            }
+            if (q < end && *q == '\r') {
+                q += 1;
+            }
+            if (q < end && *q == '\n') {
+                q += 1;
+            }
+            p = find_bytes(q, end, "endstream");
+            if (p == NULL) {
+                break;
+            }
+            if (font_keys[i] != NULL) {
+                size += p - q;
+            }
+            q = p + 9;
+        }
+    } else {
+        for (p = data; (p = find_bytes(p, end, "%%BeginResource: font"))
+                != NULL; p = q + 13) {
+            q = find_bytes(p, end, "%%EndResource");
+            if (q == NULL) {
+                break;
+            }
+            p = memchr(p, '\n', q - p);
+            if (p != NULL) {
+                size += q - p - 1;
+            }
+        }
+    }
+
+    munmap((void *)data, st.st_size);
+    return size;
+}
+
+
+static struct Font *
+get_font(int bold, int italic)
+{
+    return fonts[bold != 0][italic != 0];
+}
+
+
+static struct Glyph *
+glyph_cache_map_slot(struct GlyphCache *cache, unsigned long codepoint)
+{
+    struct GlyphEntry *old;
+    size_t old_size;
+    size_t mask;
+    size_t h;
+    size_t i;
+
+    if ((cache->map_count + 1) * 2 > cache->map_size) {
+        old = cache->map;
+        old_size = cache->map_size;
+        cache->map_size = (old_size == 0) ? 64 : old_size * 2;
+        cache->map = calloc(cache->map_size, sizeof(struct GlyphEntry));
+        if (cache->map == NULL) {
+            error("out of memory");
+        }
+        cache->map_count = 0;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].codepoint != 0) {
+                *glyph_cache_map_slot(cache, old[i].codepoint) = old[i].glyph;
+            }
+        }
+        free(old);
+    }
+
+    mask = cache->map_size - 1;
+    for (h = (codepoint * 2654435761UL) & mask; ; h = (h + 1) & mask) {
+        if (cache->map[h].codepoint == codepoint) {
+            return &cache->map[h].glyph;
+        }
+        if (cache->map[h].codepoint == 0) {
+            cache->map[h].codepoint = codepoint;
+            cache->map_count += 1;
+            return &cache->map[h].glyph;
+        }
+    }
+}
+
+
+static const struct Glyph *
+lookup_glyph(struct Font *font, unsigned long codepoint)
+{
+    struct GlyphCache *cache = &font->glyphs;
+    struct Glyph *glyph;
+    cairo_glyph_t *glyphs = NULL;
+    int num_glyphs = 0;
+    cairo_text_extents_t te;
+    char str[UTF8_MAX];
+    int len;
+    enum Phase prev;
+
+    if (codepoint < GLYPH_BMP_SIZE) {
+        if (cache->bmp == NULL) {
+            cache->bmp = calloc(GLYPH_BMP_SIZE, sizeof(struct Glyph));
+            if (cache->bmp == NULL) {
+                error("out of memory");
+            }
+        }
+        glyph = &cache->bmp[codepoint];
+    } else {
+        glyph = glyph_cache_map_slot(cache, codepoint);
+    }
+
+    if (glyph->valid) {
+        return glyph;
+    }
+
+    prev = STATS_PHASE(PHASE_MEASURE);
+    len = utf8_encode(codepoint, str);
+    if (cairo_scaled_font_text_to_glyphs(font->scaled_font, 0, 0, str, len,
+                &glyphs, &num_glyphs, NULL, NULL, NULL)
+            != CAIRO_STATUS_SUCCESS || num_glyphs != 1) {
+        error("cannot map character to glyph: U+%04lX", codepoint);
+    }
+    cairo_scaled_font_glyph_extents(font->scaled_font, glyphs, 1, &te);
+
+    glyph->index = glyphs[0].index;
+    glyph->advance = te.x_advance;
+    glyph->blank = (te.width == 0 && te.height == 0);
+    glyph->valid = 1;
+
+    cairo_glyph_free(glyphs);
+    STATS_PHASE(prev);
+
+    return glyph;
+}
+
+
+/* Map a run of decoded codepoints to glyph indices, keeping each advance
+ * in x until the glyphs are positioned.  Glyphs already cached for the
+ * BMP are read straight from the table; only the others are looked up. */
+static void
+map_glyphs(struct Font *font, const uint32_t *codepoints, int num_glyphs,
+        cairo_glyph_t *glyphs)
+{
+    const struct Glyph *bmp = font->glyphs.bmp;
+    const struct Glyph *glyph;
+    uint32_t c;
+    int i;
+
+    for (i = 0; i < num_glyphs; ++i) {
+        c = codepoints[i];
+        if (bmp != NULL && c < GLYPH_BMP_SIZE && bmp[c].valid) {
+            glyph = &bmp[c];
+        } else {
+            glyph = lookup_glyph(font, c);
+            bmp = font->glyphs.bmp;
+        }
+        glyphs[i].index = (page_files && glyph->blank)
+            ? BLANK_GLYPH : glyph->index;
+        glyphs[i].x = glyph->advance;
+    }
+}
+
+
+static double
+text_width(struct Font *font, const char *text)
+{
+    uint32_t *codepoints;
+    size_t num_codepoints;
+    size_t len;
+    size_t i;
+    double width = 0;
+
+    len = strlen(text);
+    codepoints = arena_alloc(&scratch_arena, (len + 1) * sizeof(uint32_t));
+    num_codepoints = utf8_decode(text, len, codepoints);
+    for (i = 0; i < num_codepoints; ++i) {
+        width += lookup_glyph(font, codepoints[i])->advance;
+    }
+
+    return width;
+}
+
+
+/* Pages are taken from the free list, so their arenas are reused. */
+static struct Page *
+page_create()
+{
+    struct Page *page;
+
+    if (free_pages != NULL) {
+        page = free_pages;
+        free_pages = page->next_free;
+        page->next_free = NULL;
+    } else {
+        page = calloc(1, sizeof(struct Page));
+        if (page == NULL) {
+            error("out of memory");
+        }
+        arena_init(&page->arena, PAGE_ARENA_SIZE);
+    }
+
+    page->width = options.paper_width;
+    page->height = options.paper_height;
+    page->background_color = background;
+    if (background_source != NULL) {
+        page->background = cairo_pattern_reference(background_source);
+    }
+
+    return page;
+}
+
+
+/* Drop the ops and glyphs of page, keeping the buffers. */
+static void
+page_clear(struct Page *page)
+{
+    int i;
+
+    for (i = 0; i < page->num_fills; ++i) {
+        cairo_pattern_destroy(page->fills[i].source);
+    }
+    for (i = 0; i < page->num_ops; ++i) {
+        cairo_pattern_destroy(page->ops[i].source);
+    }
+    page->num_fills = 0;
+    page->num_ops = 0;
+    page->num_glyphs = 0;
+}
+
+
+static void
+page_free(struct Page *page)
+{
+    page_clear(page);
+    if (page->background != NULL) {
+        cairo_pattern_destroy(page->background);
+    }
+    if (page->recording != NULL) {
+        cairo_surface_destroy(page->recording);
+    }
+    arena_reset(&page->arena);
+    page->background = NULL;
+    page->recording = NULL;
+    page->done = 0;
+    page->bytes = 0;
+    page->fills = NULL;
+    page->fills_size = 0;
+    page->ops = NULL;
+    page->ops_size = 0;
+    page->glyphs = NULL;
+    page->glyphs_size = 0;
+
+    page->next_free = free_pages;
+    free_pages = page;
+}
+
+
+static struct Op *
+page_add_op(struct Page *page)
+{
+    struct Op *op;
+
+    if (page->num_ops == page->ops_size) {
+        page->ops_size = (page->ops_size == 0) ? 256 : page->ops_size * 2;
+        page->ops = arena_grow(&page->arena, page->ops,
+                page->num_ops * sizeof(struct Op),
+                page->ops_size * sizeof(struct Op));
+    }
+
+    op = &page->ops[page->num_ops++];
+    memset(op, 0, sizeof(*op));
+
+    return op;
+}
+
+
+/* Sums of multiples of 2^-16 of the size of a page are exact.  FreeType
+ * gives advances in 16.16 fixed point, so cells usually are. */
+static int
+exact_grid(double x)
+{
+    double scaled = x * 65536;
+
+    return scaled == (double)(long)scaled;
+}
+
+
+/* Use columns when all variants advance printable ASCII by the same cell.
+ * Glyphs of one or two cells are then placed by column instead of adding
+ * advances.  This needs the cell and the first column on an exact grid,
+ * where a column gives the same position as the sum of advances, so that
+ * lines wrap at the same glyph either way. */
+static void
+monospace_layout()
+{
+    struct Font *font;
+    double x0;
+    double limit;
+    double cell;
+    unsigned long c;
+    int bold;
+    int italic;
+
+    pc.cell = 0;
+    pc.columns = 0;
+
+    cell = lookup_glyph(get_font(0, 0), ' ')->advance;
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            font = get_font(bold, italic);
+            for (c = ' '; c <= '~'; ++c) {
+                if (lookup_glyph(font, c)->advance != cell) {
+                    return;
+                }
+            }
+        }
+    }
+
+    x0 = options.margin_left + pc.numberwidth;
+    limit = options.paper_width - options.margin_right;
+    if (cell <= 0 || x0 + cell > limit || !exact_grid(cell)
+            || !exact_grid(x0)) {
+        return;
+    }
+
+    /* The last column fitting the line as print_text() tests it. */
+    pc.columns = (int)((limit - x0) / cell);
+    while (x0 + (pc.columns + 1) * cell <= limit) {
+        pc.columns += 1;
+    }
+    while (x0 + pc.columns * cell > limit) {
+        pc.columns -= 1;
+    }
+    pc.cell = cell;
+}
+
+
+/* The column at x, or -1 when x is not on a column. */
+static int
+grid_column(double x)
+{
+    double x0;
+    int col;
+
+    if (pc.cell == 0) {
+        return -1;
+    }
+    x0 = options.margin_left + pc.numberwidth;
+    col = (int)((x - x0) / pc.cell + 0.5);
+    if (col < 0 || x0 + col * pc.cell != x) {
+        return -1;
+    }
+    return col;
+}
+
+
+static void
+page_add_fill(struct Page *page, const struct Highlight *hi,
+        double x0, double x1, double y, double height)
+{
+    struct Fill *fill;
+    int i;
+
+    /* Extend a fill of this row with the same color ending at x0. */
+    for (i = page->num_fills - 1; i >= 0 && page->fills[i].y == y; --i) {
+        fill = &page->fills[i];
+        if (fill->x1 == x0 && same_color(fill->color, hi->bg)) {
+            fill->x1 = x1;
+            return;
+        }
+    }
+
+    if (page->num_fills == page->fills_size) {
+        page->fills_size = (page->fills_size == 0)
+            ? 256 : page->fills_size * 2;
+        page->fills = arena_grow(&page->arena, page->fills,
+                page->num_fills * sizeof(struct Fill),
+                page->fills_size * sizeof(struct Fill));
+    }
+
+    STATS_ADD(COUNTER_FILLS, 1);
+    fill = &page->fills[page->num_fills++];
+    fill->color = hi->bg;
+    fill->source = cairo_pattern_reference(hi->bg_source);
+    fill->x0 = x0;
+    fill->x1 = x1;
+    fill->y = y;
+    fill->height = height;
+    fill->drawn = 0;
+}
+
+
+/* Queue the current page for drawing and start a new one.  A page out of
+ * the range is only laid out, and is dropped here. */
+static void
+finish_page()
+{
+    if (!page_in_range(pc.pagenum)) {
+        page_clear(pc.page);
+        return;
+    }
+
+    output_pages += 1;
+    pc.page->number = output_pages;
+    STATS_ADD(COUNTER_PAGES, 1);
+    if (page_cache && page_files && !page_changed(pc.page)) {
+        STATS_ADD(COUNTER_PAGES_KEPT, 1);
+        page_clear(pc.page);
+        return;
+    }
+    queue_page(pc.page);
+    pc.page = page_create();
+}
+
+
+/* FNV-1a. */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/* Hash of what draw_page() draws for page, and of the settings the page
+ * file is drawn with.  Fonts are told apart by their variant. */
+static uint64_t
+page_hash(struct Page *page)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    double rgba[4];
+    struct Fill *fill;
+    struct Op *op;
+    int variant;
+    int i;
+
+    hash = hash_bytes(hash, fonts_name, strlen(fonts_name) + 1);
+    hash = hash_bytes(hash, &fonts_size, sizeof(fonts_size));
+    hash = hash_bytes(hash, &dpi, sizeof(dpi));
+    hash = hash_bytes(hash, &page->width, sizeof(double));
+    hash = hash_bytes(hash, &page->height, sizeof(double));
+    if (page->background != NULL) {
+        hash = hash_bytes(hash, &page->background_color,
+                sizeof(struct Color));
+    }
+
+    for (i = 0; i < page->num_fills; ++i) {
+        fill = &page->fills[i];
+        hash = hash_bytes(hash, &fill->color, sizeof(struct Color));
+        hash = hash_bytes(hash, &fill->x0, sizeof(double));
+        hash = hash_bytes(hash, &fill->x1, sizeof(double));
+        hash = hash_bytes(hash, &fill->y, sizeof(double));
+        hash = hash_bytes(hash, &fill->height, sizeof(double));
+    }
+
+    for (i = 0; i < page->num_ops; ++i) {
+        op = &page->ops[i];
+        for (variant = 0; variant < 4; ++variant) {
+            if (fonts[variant >> 1][variant & 1] == op->font) {
+                break;
+            }
+        }
+        memset(rgba, 0, sizeof(rgba));
+        cairo_pattern_get_rgba(op->source, &rgba[0], &rgba[1], &rgba[2],
+                &rgba[3]);
+        hash = hash_bytes(hash, &variant, sizeof(variant));
+        hash = hash_bytes(hash, rgba, sizeof(rgba));
+        hash = hash_bytes(hash, &op->num_glyphs, sizeof(int));
+    }
+
+    return hash_bytes(hash, page->glyphs,
+            page->num_glyphs * sizeof(cairo_glyph_t));
+}
+
+
+/* Record the hash of page and tell whether its file has to be written:
+ * the hash is new or the file of the last run is gone. */
+static int
+page_changed(struct Page *page)
+{
+    struct stat st;
+    uint64_t hash;
+    char *path;
+    int n = page->number - 1;
+    int changed;
+
+    if (n >= page_hashes_size) {
+        page_hashes_size = (page_hashes_size == 0) ? 64 : n * 2;
+        page_hashes = realloc(page_hashes,
+                page_hashes_size * sizeof(uint64_t));
+        if (page_hashes == NULL) {
+            error("out of memory");
+        }
+    }
+    hash = page_hash(page);
+    page_hashes[n] = hash;
+
+    if (n >= num_cached_hashes || cached_hashes[n] != hash) {
+        return 1;
+    }
+    path = page_path(page->number);
+    changed = (stat(path, &st) != 0);
+    free(path);
+    return changed;
+}
+
+
+/* Backgrounds are drawn first, one path per color.  Source and font of
+ * the glyphs are only set when they change between ops. */
+static void
+draw_page(cairo_t *cr, struct Page *page)
+{
+    cairo_pattern_t *source = NULL;
+    struct Font *font = NULL;
+    struct Color color;
+    struct Fill *fill;
+    struct Op *op;
+    int i;
+    int j;
+
+    if (page->background != NULL) {
+        cairo_set_source(cr, page->background);
+        cairo_paint(cr);
+    }
+
+    for (i = 0; i < page->num_fills; ++i) {
+        if (page->fills[i].drawn) {
+            continue;
+        }
+        color = page->fills[i].color;
+        cairo_set_source(cr, page->fills[i].source);
+        for (j = i; j < page->num_fills; ++j) {
+            fill = &page->fills[j];
+            if (!fill->drawn && same_color(fill->color, color)) {
+                cairo_rectangle(cr, fill->x0, fill->y, fill->x1 - fill->x0,
+                        fill->height);
+                fill->drawn = 1;
+            }
+        }
+        cairo_fill(cr);
+    }
+
+    for (i = 0; i < page->num_ops; ++i) {
+        op = &page->ops[i];
+        if (source != op->source) {
+            cairo_set_source(cr, op->source);
+            source = op->source;
+        }
+        if (font != op->font) {
+            cairo_set_scaled_font(cr, op->font->scaled_font);
+            font = op->font;
+        }
+        cairo_show_glyphs(cr, page->glyphs + op->glyph_start,
+                op->num_glyphs);
+        /* Only outlines, so the text of a pdf is not doubled. */
+        if (op->font->emboldening != 0) {
+            cairo_translate(cr, op->font->emboldening, 0);
+            cairo_glyph_path(cr, page->glyphs + op->glyph_start,
+                    op->num_glyphs);
+            cairo_fill(cr);
+            cairo_translate(cr, -op->font->emboldening, 0);
+        }
+    }
+}
+
+
+/* Record queued pages into recording surfaces, in the order they are
+ * taken from render_next, until the queue is empty and the threads are
+ * to quit.  Page files are written by the threads. */
+static void *
+render_worker(void *arg)
+{
+    cairo_rectangle_t extents;
+    cairo_surface_t *recording;
+    struct Page *page;
+    cairo_t *rcr;
+
+    outfile = render_job.outfile;
+    page_files = render_job.page_files;
+
+    for (;;) {
+        pthread_mutex_lock(&render_mutex);
+        while (render_next == queue_tail && !render_quit) {
+            pthread_cond_wait(&queue_cond, &render_mutex);
+        }
+        if (render_next == queue_tail) {
+            pthread_mutex_unlock(&render_mutex);
+            break;
+        }
+        page = queue[render_next++ % queue_size];
+        pthread_mutex_unlock(&render_mutex);
+
+        recording = NULL;
+        if (page_files) {
+            write_page(page, page->number);
+        } else {
+            extents.x = 0;
+            extents.y = 0;
+            extents.width = page->width;
+            extents.height = page->height;
+            recording = cairo_recording_surface_create(
+                    CAIRO_CONTENT_COLOR_ALPHA, &extents);
+            rcr = cairo_create(recording);
+            draw_page(rcr, page);
+            cairo_destroy(rcr);
+        }
+
+        pthread_mutex_lock(&render_mutex);
+        page->recording = recording;
+        page->done = 1;
+        pthread_cond_broadcast(&render_cond);
+        pthread_mutex_unlock(&render_mutex);
+    }
+
+    return arg;
+}
+
+
+/* The threads live until the output is finished, so layout of the next
+ * pages goes on while they draw. */
+static void
+start_render()
+{
+    int i;
+
+    queue_size = threads * PAGE_BATCH;
+    queue = malloc(queue_size * sizeof(struct Page *));
+    render_threads = malloc(threads * sizeof(pthread_t));
+    if (queue == NULL || render_threads == NULL) {
+        error("out of memory");
+    }
+    queue_head = 0;
+    queue_tail = 0;
+    render_next = 0;
+    render_quit = 0;
+    render_job.outfile = outfile;
+    render_job.page_files = page_files;
+
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&render_threads[i], NULL, render_worker, NULL)
+                != 0) {
+            error("pthread_create failed");
+        }
+    }
+    num_render_threads = threads;
+}
+
+
+static void
+stop_render()
+{
+    int i;
+
+    if (render_threads == NULL) {
+        return;
+    }
+
+    draw_pages();
+
+    pthread_mutex_lock(&render_mutex);
+    render_quit = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&render_mutex);
+
+    for (i = 0; i < num_render_threads; ++i) {
+        pthread_join(render_threads[i], NULL);
+    }
+    free(render_threads);
+    render_threads = NULL;
+    num_render_threads = 0;
+    free(queue);
+    queue = NULL;
+}
+
+
+/* Hand a page to the render threads, first making room in the queue.
+ * Without threads the page is output at once. */
+static void
+queue_page(struct Page *page)
+{
+    enum Phase prev;
+
+    prev = STATS_PHASE(PHASE_DRAW);
+    if (threads <= 1) {
+        if (page_files) {
+            write_page(page, page->number);
+        } else {
+            draw_page(cr, page);
+        }
+        output_page(page);
+        STATS_PHASE(prev);
+        return;
+    }
+
+    if (render_threads == NULL) {
+        start_render();
+    }
+    output_done(queue_size - 1);
+
+    pthread_mutex_lock(&render_mutex);
+    queue[queue_tail++ % queue_size] = page;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&render_mutex);
+    STATS_PHASE(prev);
+}
+
+
+/* Finish a drawn page.  A recorded page is replayed to the surface. */
+static void
+output_page(struct Page *page)
+{
+    STATS_ADD(COUNTER_BYTES, page->bytes);
+    if (!page_files) {
+        if (page->recording != NULL) {
+            cairo_set_source_surface(cr, page->recording, 0, 0);
+            cairo_paint(cr);
+        }
+        cairo_show_page(cr);
+    }
+    page_free(page);
+}
+
+
+/* Output the pages done by the threads in order, waiting for them while
+ * more than keep pages are queued. */
+static void
+output_done(int keep)
+{
+    struct Page *page;
+
+    pthread_mutex_lock(&render_mutex);
+    while (queue_head < queue_tail) {
+        page = queue[queue_head % queue_size];
+        if (!page->done) {
+            if (queue_tail - queue_head <= keep) {
+                break;
+            }
+            pthread_cond_wait(&render_cond, &render_mutex);
+            continue;
+        }
+        queue_head++;
+        pthread_mutex_unlock(&render_mutex);
+        output_page(page);
+        pthread_mutex_lock(&render_mutex);
+    }
+    pthread_mutex_unlock(&render_mutex);
+}
+
+
+/* Wait for the queued pages and output them. */
+static void
+draw_pages()
+{
+    enum Phase prev;
+
+    if (render_threads == NULL) {
+        return;
+    }
+    prev = STATS_PHASE(PHASE_DRAW);
+    output_done(0);
+    STATS_PHASE(prev);
+}
+
+
+static void
+write_page(struct Page *page, int pagenum)
+{
+    struct stat st;
+    char *path;
+
+    path = page_path(pagenum);
+    if (endswith(outfile, ".svg")) {
+        svg_page(page, path);
+    } else {
+        raster_page(page, path);
+    }
+    if (stat(path, &st) == 0) {
+        page->bytes = st.st_size;
+    }
+    free(path);
+}
+
+
+/* Draw a page on an image of dpi resolution.  Threads share the scaled
+ * fonts and with them the glyphs cairo has rendered. */
+static void
+raster_page(struct Page *page, const char *path)
+{
+    cairo_surface_t *image;
+    cairo_t *icr;
+    double scale;
+
+    scale = dpi / 72.0;
+    image = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+            (int)(page->width * scale + 0.5),
+            (int)(page->height * scale + 0.5));
+    icr = cairo_create(image);
+    cairo_scale(icr, scale, scale);
+    cairo_set_source_rgb(icr, 1, 1, 1);
+    cairo_paint(icr);
+    draw_page(icr, page);
+    cairo_destroy(icr);
+
+    if (endswith(outfile, ".ppm")) {
+        write_ppm(image, path);
+    } else if (cairo_surface_write_to_png(image, path)
+            != CAIRO_STATUS_SUCCESS) {
+        error("cannot write: %s", path);
+    }
+
+    cairo_surface_destroy(image);
+}
+
+
+/* cairo defines the outline of each glyph once per file and draws an op
+ * as a group of uses of it with the color of the highlight.  Blank
+ * glyphs are left out by print_glyphs(). */
+static void
+svg_page(struct Page *page, const char *path)
+{
+    cairo_surface_t *svg;
+    cairo_t *scr;
+
+    svg = cairo_svg_surface_create(path, page->width, page->height);
+    scr = cairo_create(svg);
+    draw_page(scr, page);
+    cairo_destroy(scr);
+
+    cairo_surface_finish(svg);
+    if (cairo_surface_status(svg) != CAIRO_STATUS_SUCCESS) {
+        error("cannot write: %s", path);
+    }
+    cairo_surface_destroy(svg);
+}
+
+
+/* "out.png" is written as "out-1.png", "out-2.png", ... */
+static char *
+page_path(int pagenum)
+{
+    const char *ext;
+    char *path;
+
+    ext = strrchr(outfile, '.');
+    path = malloc(strlen(outfile) + 16);
+    if (path == NULL) {
+        error("out of memory");
+    }
+    sprintf(path, "%.*s-%d%s", (int)(ext - outfile), outfile, pagenum, ext);
+    return path;
+}
+
+
+/* Remove the page files of an earlier output from pagenum on, so that a
+ * shorter output leaves none of them behind.  They end at the first
+ * missing file past the pages of the cache. */
+static void
+remove_page_files(int pagenum)
+{
+    char *path;
+    int removed;
+
+    for (;; ++pagenum) {
+        path = page_path(pagenum);
+        removed = (unlink(path) == 0);
+        free(path);
+        if (!removed && pagenum > num_cached_hashes) {
+            break;
+        }
+    }
+}
+
+
+/* Raw PPM is written without compression, for speed. */
+static void
+write_ppm(cairo_surface_t *image, const char *path)
+{
+    const unsigned char *data;
+    const uint32_t *pixel;
+    unsigned char *row;
+    FILE *fp;
+    int width;
+    int height;
+    int stride;
+    int x;
+    int y;
+
+    cairo_surface_flush(image);
+    data = cairo_image_surface_get_data(image);
+    width = cairo_image_surface_get_width(image);
+    height = cairo_image_surface_get_height(image);
+    stride = cairo_image_surface_get_stride(image);
+
+    row = malloc(width * 3);
+    if (row == NULL) {
+        error("out of memory");
+    }
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        error("cannot write: %s", path);
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (y = 0; y < height; ++y) {
+        /* RGB24 is a native endian 0x00RRGGBB per pixel. */
+        pixel = (const uint32_t *)(data + y * stride);
+        for (x = 0; x < width; ++x) {
+            row[x * 3] = (pixel[x] >> 16) & 0xFF;
+            row[x * 3 + 1] = (pixel[x] >> 8) & 0xFF;
+            row[x * 3 + 2] = pixel[x] & 0xFF;
+        }
+        fwrite(row, 1, width * 3, fp);
+    }
+    if (fclose(fp) != 0) {
+        error("cannot write: %s", path);
+    }
+
+    free(row);
+}
+
+
+static int
+page_in_range(int pagenum)
+{
+    if (options.page_first == 0) {
+        return 1;
+    }
+    return pagenum >= options.page_first
+        && (options.page_last == 0 || pagenum <= options.page_last);
 }
 
 
 static void
 newline()
 {
+    enum Phase prev;
+
+    prev = STATS_PHASE(PHASE_LAYOUT);
     if (pc.linenum == 0) {
         newpage();
     } else {
@@ -493,223 +2367,853 @@ newline()
         }
     }
 
-    pc.linenum += 1;
+    pc.linenum += 1;
+
+    print_number();
+
+    pc.x = options.margin_left + pc.numberwidth;
+    STATS_PHASE(prev);
+}
+
+
+static void
+newpage()
+{
+    if (pc.pagenum != 0) {
+        finish_page();
+    }
+
+    pc.pagenum += 1;
+
+    print_header();
+
+    pc.x = options.margin_left + pc.numberwidth;
+    pc.y = options.margin_top + pc.font_height * (1 + options.header_extraline);
+}
+
+
+static void
+print_number()
+{
+    struct Highlight *hi = &linenr_highlight;
+    char fmt[256];
+    char buf[256];
+
+    if (options.number_width <= 0) {
+        return;
+    }
+
+    sprintf(fmt, "%%%dd", options.number_width);
+    sprintf(buf, fmt, pc.linenum);
+
+    pc.x = options.margin_left + pc.numberwidth - LINENR_MARGIN
+        - text_width(get_font(hi->bold, hi->italic), buf);
+    print_text(buf, hi);
+}
+
+
+static void
+print_header()
+{
+    struct Highlight *hi = &header_highlight;
+    char left[1024];
+    char right[1024];
+    char *out;
+    char *p;
+
+    if (options.header_format == NULL || options.header_format[0] == '\0') {
+        return;
+    }
+
+    left[0] = '\0';
+    right[0] = '\0';
+
+    out = left;
+
+    for (p = options.header_format; *p != '\0'; ++p) {
+        if (*p == '%') {
+            ++p;
+            if (*p == '%') {
+                *out++ = '%';
+            } else if (*p == 'N') {
+                out += sprintf(out, "%d", pc.pagenum);
+            } else if (*p == '=') {
+                out = right;
+            } else {
+                error("unknown header item: %c", *p);
+            }
+        } else {
+            *out++ = *p;
+        }
+        *out = '\0';
+    }
+
+    pc.x = options.margin_left;
+    pc.y = options.margin_top;
+    print_text(left, hi);
+
+    pc.x = options.paper_width - options.margin_right
+        - text_width(get_font(hi->bold, hi->italic), right);
+    pc.y = options.margin_top;
+    print_text(right, hi);
+}
+
+
+/* Record a positioned segment of a run on the current page.  Glyphs
+ * following glyphs of the same font and source join their op. */
+static void
+print_glyphs(struct Font *font, cairo_glyph_t *glyphs,
+        int num_glyphs, double x, const struct Highlight *hi)
+{
+    struct Page *page = pc.page;
+    struct Op *op;
+    double baseline;
+    int i;
+    int n;
+    int size;
+
+    if (num_glyphs == 0 || !page_in_range(pc.pagenum)) {
+        return;
+    }
+
+    if (!same_color(hi->bg, page->background_color)) {
+        page_add_fill(page, hi, x, pc.x, pc.y, pc.font_height);
+    }
+
+    if (page->num_glyphs + num_glyphs > page->glyphs_size) {
+        size = page->glyphs_size;
+        while (page->num_glyphs + num_glyphs > page->glyphs_size) {
+            page->glyphs_size = (page->glyphs_size == 0)
+                ? 4096 : page->glyphs_size * 2;
+        }
+        page->glyphs = arena_grow(&page->arena, page->glyphs,
+                size * sizeof(cairo_glyph_t),
+                page->glyphs_size * sizeof(cairo_glyph_t));
+    }
+
+    baseline = pc.y + pc.font_height - pc.font_descent;
+    n = 0;
+    for (i = 0; i < num_glyphs; ++i) {
+        if (glyphs[i].index != BLANK_GLYPH) {
+            page->glyphs[page->num_glyphs + n] = glyphs[i];
+            page->glyphs[page->num_glyphs + n].y = baseline;
+            n += 1;
+        }
+    }
+    num_glyphs = n;
+    if (num_glyphs == 0) {
+        return;
+    }
+
+    STATS_ADD(COUNTER_GLYPHS, num_glyphs);
+
+    op = (page->num_ops > 0) ? &page->ops[page->num_ops - 1] : NULL;
+    if (op != NULL && op->font == font && op->source == hi->fg_source) {
+        op->num_glyphs += num_glyphs;
+    } else {
+        /* draw_page() sets the font when it changes between ops. */
+        if (op == NULL || op->font != font) {
+            STATS_ADD(COUNTER_FONT_SWITCHES, 1);
+        }
+        op = page_add_op(page);
+        op->source = cairo_pattern_reference(hi->fg_source);
+        op->font = font;
+        op->glyph_start = page->num_glyphs;
+        op->num_glyphs = num_glyphs;
+    }
+
+    page->num_glyphs += num_glyphs;
+}
+
+
+/* Place a run of printable ASCII by column.  Each byte takes one cell, so
+ * neither decoding nor advances are needed and the run is cut at the
+ * columns left in the line.  Returns 0, having printed nothing, when the
+ * run has other bytes. */
+static int
+print_columns(struct Font *font, const char *text, size_t len, int col,
+        const struct Highlight *hi)
+{
+    const struct Glyph *glyph;
+    cairo_glyph_t *glyphs;
+    double x0;
+    int start;
+    int n;
+    int i;
+    int j;
+    unsigned char c;
+
+    glyphs = arena_alloc(&scratch_arena, (len + 1) * sizeof(cairo_glyph_t));
+    for (i = 0; i < (int)len; ++i) {
+        c = (unsigned char)text[i];
+        if (c < ' ' || c > '~') {
+            return 0;
+        }
+        glyph = lookup_glyph(font, c);
+        glyphs[i].index = (page_files && glyph->blank)
+            ? BLANK_GLYPH : glyph->index;
+    }
+
+    x0 = options.margin_left + pc.numberwidth;
+    for (start = 0; start < (int)len; start += n) {
+        if (col == pc.columns) {
+            pc.y += pc.font_height;
+            if (pc.y + pc.font_height >
+                    options.paper_height - options.margin_bottom) {
+                newpage();
+            }
+            pc.x = x0;
+            col = 0;
+        }
+
+        n = pc.columns - col;
+        if (n > (int)len - start) {
+            n = (int)len - start;
+        }
+        for (j = 0; j < n; ++j) {
+            glyphs[start + j].x = x0 + (col + j) * pc.cell;
+        }
+        col += n;
+        pc.x = x0 + col * pc.cell;
+        print_glyphs(font, glyphs + start, n, glyphs[start].x, hi);
+    }
+
+    return 1;
+}
+
+
+static void
+print_text(const char *text, const struct Highlight *hi)
+{
+    struct Font *font;
+    cairo_glyph_t *glyphs;
+    uint32_t *codepoints;
+    size_t len;
+    int num_glyphs;
+    int start;
+    int i;
+    double x;
+    double advance;
+    int col;
+    int cells;
+    enum Phase prev;
+
+    /* Nothing after the range changes the printed pages. */
+    if (options.page_last != 0 && pc.pagenum > options.page_last) {
+        return;
+    }
+
+    prev = STATS_PHASE(PHASE_LAYOUT);
+
+    font = get_font(hi->bold, hi->italic);
+
+    len = strlen(text);
+    col = grid_column(pc.x);
+    if (col >= 0 && print_columns(font, text, len, col, hi)) {
+        STATS_PHASE(prev);
+        return;
+    }
+
+    /* The run has at most one glyph per byte.  Invalid UTF-8 is shown as
+     * U+FFFD.  Advances are kept in x until the glyphs are positioned. */
+    codepoints = arena_alloc(&scratch_arena, (len + 1) * sizeof(uint32_t));
+    glyphs = arena_alloc(&scratch_arena, (len + 1) * sizeof(cairo_glyph_t));
+    num_glyphs = utf8_decode(text, len, codepoints);
+    map_glyphs(font, codepoints, num_glyphs, glyphs);
+
+    /* Glyphs of a fixed pitch font take one cell, or two for East Asian
+     * wide characters, and are wrapped by column.  Others are placed by
+     * their advance for the rest of the run. */
+    start = 0;
+    x = pc.x;
+    for (i = 0; i < num_glyphs; ++i) {
+        advance = glyphs[i].x;
+
+        cells = 0;
+        if (col >= 0) {
+            if (advance == pc.cell) {
+                cells = 1;
+            } else if (advance == 2 * pc.cell) {
+                cells = 2;
+            } else {
+                col = -1;
+            }
+        }
+
+        if (cells > 0 ? col + cells > pc.columns : pc.x + advance
+                > options.paper_width - options.margin_right) {
+            print_glyphs(font, glyphs + start, i - start, x, hi);
+            start = i;
+
+            pc.y += pc.font_height;
+            if (pc.y + pc.font_height >
+                    options.paper_height - options.margin_bottom) {
+                newpage();
+            }
+            pc.x = options.margin_left + pc.numberwidth;
+            x = pc.x;
+            if (cells > 0) {
+                col = 0;
+            }
+        }
+
+        glyphs[i].x = pc.x;
+        if (cells > 0) {
+            col += cells;
+            pc.x = options.margin_left + pc.numberwidth + col * pc.cell;
+        } else {
+            pc.x += advance;
+        }
+    }
+    print_glyphs(font, glyphs + start, num_glyphs - start, x, hi);
+
+    STATS_PHASE(prev);
+}
 
-    print_number();
 
-    pc.x = options.margin_left + pc.numberwidth;
+/* Returns 1 when --geometry stopped it at START, where the layout of
+ * the pages is known. */
+static int
+print()
+{
+    enum Command command;
+
+    while (!lexer_eof(&lexer)) {
+        command = lexer_command(&lexer);
+        STATS_ADD(COUNTER_COMMANDS, 1);
+        switch (command) {
+        case COMMAND_PAPER:
+            command_paper();
+            break;
+        case COMMAND_MARGIN:
+            command_margin();
+            break;
+        case COMMAND_HEADER:
+            command_header();
+            break;
+        case COMMAND_NUMBER:
+            command_number();
+            break;
+        case COMMAND_LINESPACE:
+            command_linespace();
+            break;
+        case COMMAND_FONT:
+            command_font();
+            break;
+        case COMMAND_PAGES:
+            command_pages();
+            break;
+        case COMMAND_TITLE:
+            command_title();
+            break;
+        case COMMAND_HIGHLIGHT:
+            command_highlight();
+            break;
+        case COMMAND_TEXT:
+            command_text();
+            break;
+        case COMMAND_HIGHDEF:
+            command_highdef();
+            break;
+        case COMMAND_RUN:
+            command_run();
+            break;
+        case COMMAND_LINE:
+            command_line();
+            break;
+        case COMMAND_START:
+            command_start();
+            if (geometry) {
+                return 1;
+            }
+            break;
+        case COMMAND_END:
+            command_end();
+            break;
+        default:
+            error("unknown command: %s", command_name(command));
+        }
+        arena_reset(&scratch_arena);
+    }
+    return 0;
 }
 
 
 static void
-newpage()
+add_job(const char *infile, const char *outfile)
 {
-    if (pc.pagenum != 0) {
-        cairo_show_page(cr);
+    if (num_jobs == jobs_size) {
+        jobs_size = (jobs_size == 0) ? 64 : jobs_size * 2;
+        jobs = realloc(jobs, jobs_size * sizeof(struct Job));
+        if (jobs == NULL) {
+            error("out of memory");
+        }
     }
+    jobs[num_jobs].infile = strdup(infile);
+    jobs[num_jobs].outfile = strdup(outfile);
+    num_jobs += 1;
+}
 
-    pc.pagenum += 1;
 
-    print_header();
+/* A manifest has a job per line: infile, a tab and outfile.  Empty lines
+ * and lines starting with "#" are skipped. */
+static void
+read_manifest(const char *path)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    char *tab;
+    int lnum = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        error("cannot open: %s", path);
+    }
 
-    pc.x = options.margin_left + pc.numberwidth;
-    pc.y = options.margin_top + pc.font_height * (1 + options.header_extraline);
+    while ((len = getline(&line, &size, fp)) != -1) {
+        lnum += 1;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        tab = strchr(line, '\t');
+        if (tab == NULL) {
+            error("%s:%d: expected infile<TAB>outfile", path, lnum);
+        }
+        *tab = '\0';
+        add_job(line, tab + 1);
+    }
+
+    free(line);
+    fclose(fp);
 }
 
 
+/* Every dump in a directory is printed to a pdf of the same name.  Other
+ * files, such as output and caches, do not start like a dump and are
+ * skipped.  Dumps that would be printed to the same pdf are an error. */
 static void
-print_number()
+read_directory(const char *path)
 {
-    char fmt[256];
-    char buf[256];
-    cairo_text_extents_t te;
-    struct Highlight hi;
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    char *infile;
+    char *outfile;
+    char *ext;
+    int i;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        error("cannot open: %s", path);
+    }
 
-    if (options.number_width <= 0) {
-        return;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || endswith(ent->d_name, ".pdf")) {
+            continue;
+        }
+
+        infile = malloc(strlen(path) + strlen(ent->d_name) + 2);
+        outfile = malloc(strlen(path) + strlen(ent->d_name) + 6);
+        if (infile == NULL || outfile == NULL) {
+            error("out of memory");
+        }
+        sprintf(infile, "%s/%s", path, ent->d_name);
+        if (stat(infile, &st) == 0 && S_ISREG(st.st_mode)
+                && lexer_probe(infile)) {
+            strcpy(outfile, infile);
+            ext = strrchr(outfile + strlen(path) + 2, '.');
+            if (ext == NULL) {
+                ext = outfile + strlen(outfile);
+            }
+            strcpy(ext, ".pdf");
+            add_job(infile, outfile);
+        }
+        free(infile);
+        free(outfile);
     }
 
-    sprintf(fmt, "%%%dd", options.number_width);
-    sprintf(buf, fmt, pc.linenum);
+    closedir(dir);
 
-    /* FIXME: load from file */
-    hi.name = "LineNr";
-    hi.fg.r = 0;
-    hi.fg.g = 0;
-    hi.fg.b = 0;
-    hi.bg.r = 1;
-    hi.bg.g = 1;
-    hi.bg.b = 1;
-    hi.sp = hi.fg;
-    hi.bold = 0;
-    hi.italic = 0;
-    hi.underline = 0;
-    hi.undercurl = 0;
-
-    cairo_text_extents(cr, buf, &te);
-    pc.x = options.margin_left + pc.numberwidth - LINENR_MARGIN - te.x_advance;
-    print_text(buf, hi);
+    qsort(jobs, num_jobs, sizeof(struct Job), compare_outfiles);
+    for (i = 1; i < num_jobs; ++i) {
+        if (strcmp(jobs[i - 1].outfile, jobs[i].outfile) == 0) {
+            error("%s and %s are both printed to %s", jobs[i - 1].infile,
+                    jobs[i].infile, jobs[i].outfile);
+        }
+    }
+
+    qsort(jobs, num_jobs, sizeof(struct Job), compare_jobs);
+}
+
+
+static int
+compare_jobs(const void *a, const void *b)
+{
+    return strcmp(((const struct Job *)a)->infile,
+            ((const struct Job *)b)->infile);
+}
+
+
+static int
+compare_outfiles(const void *a, const void *b)
+{
+    return strcmp(((const struct Job *)a)->outfile,
+            ((const struct Job *)b)->outfile);
 }
 
 
 static void
-print_header()
+run_job(struct Job *job)
 {
-    char left[1024];
-    char right[1024];
-    char *out;
-    char *p;
-    cairo_text_extents_t te;
-    struct Highlight hi;
+    infile = job->infile;
+    outfile = job->outfile;
 
-    if (options.header_format == NULL || options.header_format[0] == '\0') {
-        return;
+    lexer_open(&lexer, infile);
+    if (page_cache) {
+        load_page_cache();
     }
 
-    left[0] = '\0';
-    right[0] = '\0';
+    print();
 
-    out = left;
+    lexer_close(&lexer);
 
-    for (p = options.header_format; *p != '\0'; ++p) {
-        if (*p == '%') {
-            ++p;
-            if (*p == '%') {
-                *out++ = '%';
-            } else if (*p == 'N') {
-                out += sprintf(out, "%d", pc.pagenum);
-            } else if (*p == '=') {
-                out = right;
-            } else {
-                error("unknown header item: %c", *p);
-            }
-        } else {
-            *out++ = *p;
+    finish_output();
+    reset_job();
+}
+
+
+/* Forget the settings and highlights of a document.  Fonts are kept. */
+static void
+reset_job()
+{
+    int i;
+
+    for (i = 0; i < highlights_size; ++i) {
+        if (highlights[i].name != NULL) {
+            highlight_free(&highlights[i]);
         }
-        *out = '\0';
+    }
+    if (pc.hi.name != NULL) {
+        highlight_free(&pc.hi);
+    }
+    if (background_source != NULL) {
+        cairo_pattern_destroy(background_source);
+        background_source = NULL;
     }
 
-    /* FIXME: load from file */
-    hi.name = "PageHeader";
-    hi.fg.r = 0;
-    hi.fg.g = 0;
-    hi.fg.b = 0;
-    hi.bg.r = 1;
-    hi.bg.g = 1;
-    hi.bg.b = 1;
-    hi.sp = hi.fg;
-    hi.bold = 0;
-    hi.italic = 0;
-    hi.underline = 0;
-    hi.undercurl = 0;
+    memset(&options, 0, sizeof(options));
+    memset(&pc, 0, sizeof(pc));
+    if (names != NULL) {
+        memset(names, 0, names_size * sizeof(char *));
+    }
+    num_names = 0;
+    arena_reset(&job_arena);
 
-    pc.x = options.margin_left;
-    pc.y = options.margin_top;
-    print_text(left, hi);
+    foreground.r = foreground.g = foreground.b = 0;
+    background.r = background.g = background.b = 1;
+}
 
-    cairo_text_extents(cr, right, &te);
-    pc.x = options.paper_width - options.margin_right - te.x_advance;
-    pc.y = options.margin_top;
-    print_text(right, hi);
+
+/* Run a job of a batch thread.  Returns 0 when it failed. */
+static int
+try_job(struct Job *job)
+{
+    jmp_buf failed;
+
+    if (setjmp(failed) != 0) {
+        job_failed = NULL;
+        abort_job();
+        return 0;
+    }
+    job_failed = &failed;
+    run_job(job);
+    job_failed = NULL;
+    return 1;
 }
 
 
+/* Let go of what a failed job holds and remove its output.  Its fonts may
+ * be half loaded, so the next job loads them again. */
 static void
-print_text(const char *text, struct Highlight hi)
+abort_job()
 {
-    cairo_text_extents_t te;
-    const char *p;
-    int len;
-    char buf[256];
+    if (lexer.buf != NULL) {
+        lexer_close(&lexer);
+    }
+    if (pc.page != NULL) {
+        page_free(pc.page);
+        pc.page = NULL;
+    }
+    if (cr != NULL) {
+        cairo_destroy(cr);
+        cr = NULL;
+    }
+    if (surface != NULL) {
+        cairo_surface_destroy(surface);
+        surface = NULL;
+        unlink(outfile);
+    }
+    highlight_free(&linenr_highlight);
+    highlight_free(&header_highlight);
 
-    set_font(options.font_name, options.font_size, hi.bold, hi.italic);
+    free(cached_hashes);
+    cached_hashes = NULL;
+    num_cached_hashes = 0;
+    output_pages = 0;
 
-    /* FIXME: Is it better not to write one by one? */
-    for (p = text; *p != '\0'; p += len) {
-        len = utf8len(p);
-        memmove(buf, p, len);
-        buf[len] = '\0';
+    free_fonts();
+    reset_job();
+    arena_reset(&scratch_arena);
+}
 
-        cairo_text_extents(cr, buf, &te);
 
-        if (pc.x + te.x_advance > options.paper_width - options.margin_right) {
-            pc.y += pc.font_height;
-            if (pc.y + pc.font_height >
-                    options.paper_height - options.margin_bottom) {
-                newpage();
-            }
-            pc.x = options.margin_left + pc.numberwidth;
+/* Take jobs until none is left.  The fonts and glyph caches of the thread
+ * stay warm from one job to the next, also after a failed job, and the
+ * fontconfig and cairo caches are shared by all threads. */
+static void *
+batch_worker(void *arg)
+{
+    struct BatchState *state = arg;
+    int i;
+
+    arena_init(&scratch_arena, SCRATCH_ARENA_SIZE);
+    arena_init(&job_arena, JOB_ARENA_SIZE);
+    if (state->stats) {
+        stats_start();
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&state->mutex);
+        i = state->next;
+        state->next += 1;
+        pthread_mutex_unlock(&state->mutex);
+
+        if (i >= num_jobs) {
+            break;
         }
 
-        if (!is_white(hi.bg)) {
-            cairo_set_source_rgb(cr, hi.bg.r, hi.bg.g, hi.bg.b);
-            cairo_rectangle(cr, pc.x, pc.y, te.x_advance, pc.font_height);
-            cairo_fill(cr);
+        if (!try_job(&jobs[i])) {
+            fprintf(stderr, "failed: %s\n", jobs[i].infile);
+            pthread_mutex_lock(&state->mutex);
+            state->failed += 1;
+            pthread_mutex_unlock(&state->mutex);
         }
+    }
 
-        cairo_set_source_rgb(cr, hi.fg.r, hi.fg.g, hi.fg.b);
-        cairo_move_to(cr, pc.x, pc.y + pc.font_height - pc.font_descent);
-        cairo_show_text(cr, buf);
+    free_fonts();
 
-        pc.x += te.x_advance;
+    if (stats.enabled) {
+        flockfile(stderr);
+        stats_report(stderr, stats_json);
+        funlockfile(stderr);
     }
+
+    return arg;
 }
 
 
-static void
-print()
+/* Print the jobs of a manifest or directory on up to threads threads.  A
+ * broken dump only fails its own job, and its thread goes on with the
+ * remaining jobs. */
+static int
+batch(const char *path)
 {
-    char *command;
+    struct BatchState state;
+    struct stat st;
+    pthread_t *workers;
+    int num_workers;
+    int i;
+
+    if (stat(path, &st) != 0) {
+        error("cannot open: %s", path);
+    }
+    if (S_ISDIR(st.st_mode)) {
+        read_directory(path);
+    } else {
+        read_manifest(path);
+    }
+    if (num_jobs == 0) {
+        return EXIT_SUCCESS;
+    }
 
-    for (;;) {
-        skip_space();
-        if (feof(in)) {
-            break;
-        }
-        command = read_command();
-        if (strcmp(command, "PAPER") == 0) {
-            command_paper();
-        } else if (strcmp(command, "MARGIN") == 0) {
-            command_margin();
-        } else if (strcmp(command, "HEADER") == 0) {
-            command_header();
-        } else if (strcmp(command, "NUMBER") == 0) {
-            command_number();
-        } else if (strcmp(command, "LINESPACE") == 0) {
-            command_linespace();
-        } else if (strcmp(command, "FONT") == 0) {
-            command_font();
-        } else if (strcmp(command, "HIGHLIGHT") == 0) {
-            command_highlight();
-        } else if (strcmp(command, "TEXT") == 0) {
-            command_text();
-        } else if (strcmp(command, "LINE") == 0) {
-            command_line();
-        } else if (strcmp(command, "START") == 0) {
-            command_start();
-        } else if (strcmp(command, "END") == 0) {
-            command_end();
-        } else {
-            error("unknown command: %s", command);
+    num_workers = (threads < num_jobs) ? threads : num_jobs;
+
+    pthread_mutex_init(&state.mutex, NULL);
+    state.next = 0;
+    state.failed = 0;
+    state.stats = stats.enabled;
+
+    workers = malloc(num_workers * sizeof(pthread_t));
+    if (workers == NULL) {
+        error("out of memory");
+    }
+
+    /* Jobs run side by side, so each one draws its pages alone. */
+    threads = 1;
+
+#if CAIRO_HAS_FC_FONT
+    /* The configuration and font caches are loaded once for all threads,
+     * before they look up their first fonts. */
+    if (!FcInit()) {
+        error("FcInit failed");
+    }
+#endif
+
+    /* Errors in the input of a job end the job, not the process. */
+    lexer_fail = fail;
+
+    for (i = 0; i < num_workers; ++i) {
+        if (pthread_create(&workers[i], NULL, batch_worker, &state) != 0) {
+            error("pthread_create failed");
         }
-        free(command);
     }
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&state.mutex);
+
+    return (state.failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 
 int
 main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        {"stats", optional_argument, NULL, 's'},
+        {"cache", no_argument, NULL, 'c'},
+        {"geometry", no_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0}
+    };
+    char *batch_path = NULL;
+    int started;
+    int c;
+
+    arena_init(&scratch_arena, SCRATCH_ARENA_SIZE);
+    arena_init(&job_arena, JOB_ARENA_SIZE);
 
-    infile = argv[1];
-    outfile = argv[2];
+    while ((c = getopt_long(argc, argv, "b:j:r:v", long_options, NULL))
+            != -1) {
+        switch (c) {
+        case 's':
+            if (optarg != NULL && strcmp(optarg, "json") != 0) {
+                error("unknown stats format: %s", optarg);
+            }
+            stats_json = (optarg != NULL);
+            stats_start();
+            break;
+        case 'b':
+            batch_path = optarg;
+            break;
+        case 'c':
+            page_cache = 1;
+            break;
+        case 'g':
+            geometry = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            dpi = atof(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
 
-    in = fopen(infile, "r");
+    if (argc - optind != (batch_path != NULL ? 0 : geometry ? 1 : 2)) {
+        error("usage: %s [-v] [-j threads] [-r dpi] [--stats[=json]]"
+                " [--cache] infile outfile\n"
+                "       %s [-v] [-j threads] [-r dpi] [--stats[=json]]"
+                " [--cache] -b manifest|directory\n"
+                "       %s --geometry infile\n"
+                "infile \"-\" reads the commands from standard input.\n"
+                "-b prints every job of a manifest (lines of"
+                " \"infile<TAB>outfile\")\n"
+                "   or every dump of a directory to a pdf of the same name,\n"
+                "   printing a job on each thread.\n"
+                "outfile is a .pdf, .ps, or .png/.ppm/.svg written per page"
+                " as outfile-N.png,\n"
+                "   removing the files of an earlier output past the last"
+                " page.\n"
+                "-j sets the number of threads drawing pages (default: 1),"
+                " or the number\n"
+                "   of jobs printed at once by -b (default: number of"
+                " CPUs).\n"
+                "-r sets the resolution of images in dpi (default: 96).\n"
+                "-v reports the glyphs of each font and the size of the"
+                " output and of\n"
+                "   its embedded fonts.\n"
+                "--stats reports the time of each phase and counters"
+                " when done,\n"
+                "   as a table or with =json as a JSON object.\n"
+                "--cache keeps a hash of each page in outfile.pages and does"
+                " not write\n"
+                "   a page file again when its page is the same.\n"
+                "--geometry prints the rows of a page and the columns of a"
+                " fixed pitch\n"
+                "   font (0 for others) when infile reaches START.",
+                argv[0], argv[0], argv[0]);
+    }
 
-    print();
+    /* Pages are drawn by the main thread unless asked for, as threads
+     * draw them through recording surfaces.  Batch jobs are independent
+     * and run side by side. */
+    if (threads == 0 && batch_path != NULL) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (dpi <= 0) {
+        error("invalid resolution: %g", dpi);
+    }
+    /* Nothing is output. */
+    if (geometry) {
+        page_cache = 0;
+    }
+
+    if (batch_path != NULL) {
+        return batch(batch_path);
+    }
+
+    infile = argv[optind];
+    outfile = geometry ? NULL : argv[optind + 1];
+
+    lexer_open(&lexer, infile);
+    if (page_cache) {
+        load_page_cache();
+    }
 
-    fclose(in);
+    started = print();
+
+    lexer_close(&lexer);
+
+    if (geometry) {
+        if (!started) {
+            error("no START in %s", infile);
+        }
+        print_geometry();
+    }
+
+    finish_output();
+    free_fonts();
+
+    if (stats.enabled) {
+        stats_report(stderr, stats_json);
+    }
 
     return 0;
 }
-
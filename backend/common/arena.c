@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+
+/* Allocations are aligned for any type the backends store. */
+#define ARENA_ALIGN 16
+
+#define ARENA_HEADER \
+    ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) \
+     & ~(size_t)(ARENA_ALIGN - 1))
+
+
+static struct ArenaBlock *new_block(struct Arena *arena, size_t size);
+
+
+static struct ArenaBlock *
+new_block(struct Arena *arena, size_t size)
+{
+    struct ArenaBlock *block;
+
+    if (size < arena->block_size) {
+        size = arena->block_size;
+    }
+    block = malloc(ARENA_HEADER + size);
+    if (block == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    STATS_ADD(COUNTER_ARENA_BLOCKS, 1);
+
+    return block;
+}
+
+
+void
+arena_init(struct Arena *arena, size_t block_size)
+{
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size;
+}
+
+
+/* Blocks after current are free after a reset.  One too small for size is
+ * skipped until the next reset, and a new block is linked after current
+ * when none is left. */
+void *
+arena_alloc(struct Arena *arena, size_t size)
+{
+    struct ArenaBlock *block;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+    if (block == NULL) {
+        block = new_block(arena, size);
+        if (arena->current == NULL) {
+            arena->first = block;
+        } else {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+    arena->current = block;
+
+    ptr = (char *)block + ARENA_HEADER + block->used;
+    block->used += size;
+    STATS_ADD(COUNTER_ARENA_ALLOCS, 1);
+
+    return ptr;
+}
+
+
+/* Like realloc() of ptr, allocated with old_size.  The last allocation
+ * is grown in place when its block has room, otherwise it is copied and
+ * the old space is only given back by the reset. */
+void *
+arena_grow(struct Arena *arena, void *ptr, size_t old_size, size_t size)
+{
+    struct ArenaBlock *block;
+    void *newptr;
+    size_t aligned;
+
+    block = arena->current;
+    aligned = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (ptr != NULL && block != NULL
+            && (char *)ptr + aligned
+                == (char *)block + ARENA_HEADER + block->used) {
+        size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (block->used - aligned + size <= block->size) {
+            block->used = block->used - aligned + size;
+            return ptr;
+        }
+    }
+
+    newptr = arena_alloc(arena, size);
+    if (ptr != NULL) {
+        memcpy(newptr, ptr, old_size < size ? old_size : size);
+    }
+    return newptr;
+}
+
+
+char *
+arena_strdup(struct Arena *arena, const char *s)
+{
+    size_t len;
+    char *p;
+
+    len = strlen(s) + 1;
+    p = arena_alloc(arena, len);
+    memcpy(p, s, len);
+    return p;
+}
+
+
+void
+arena_reset(struct Arena *arena)
+{
+    struct ArenaBlock *block;
+
+    for (block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+
+void
+arena_free(struct Arena *arena)
+{
+    struct ArenaBlock *block;
+    struct ArenaBlock *next;
+
+    for (block = arena->first; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/* Bump allocator.  Memory is taken from large blocks and given back all
+ * at once by arena_reset(), which keeps the blocks for reuse, so an arena
+ * reset at the end of each command or page stops calling malloc once its
+ * blocks are big enough. */
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+
+struct Arena {
+    struct ArenaBlock *first;
+    struct ArenaBlock *current;
+    size_t block_size;
+};
+
+
+void arena_init(struct Arena *arena, size_t block_size);
+void *arena_alloc(struct Arena *arena, size_t size);
+void *arena_grow(struct Arena *arena, void *ptr, size_t old_size,
+        size_t size);
+char *arena_strdup(struct Arena *arena, const char *s);
+void arena_reset(struct Arena *arena);
+void arena_free(struct Arena *arena);
+
+#endif
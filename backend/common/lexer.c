@@ -0,0 +1,739 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lexer.h"
+
+
+#define LEXER_BUFSIZE (1024 * 1024)
+
+/* Parsed input of a mapped file is given back in steps of this size, a
+ * multiple of the page size. */
+#define LEXER_RELEASE (4 * 1024 * 1024)
+
+/* Longest command name. */
+#define COMMAND_MAX 16
+
+/* Longest number passed to strtod(). */
+#define NUMBER_MAX 64
+
+/* Integers up to 2^53 and powers of ten up to 1e22 are exact doubles. */
+#define MANTISSA_EXACT ((uint64_t)1 << 53)
+#define POWER_EXACT 22
+
+
+static void lexer_error(const char *format, ...);
+static int map_input(struct Lexer *lx);
+static void release(struct Lexer *lx);
+static size_t fill(struct Lexer *lx);
+static int peek(struct Lexer *lx);
+static int next(struct Lexer *lx);
+static void skip_space(struct Lexer *lx);
+static int hexdigit(int c);
+static unsigned long read_varint(struct Lexer *lx);
+static long read_zigzag(struct Lexer *lx);
+static enum Command keyword(const char *s, size_t len);
+static double c_strtod(const char *s, size_t len);
+
+
+void (*lexer_fail)();
+
+static const double powers_of_ten[POWER_EXACT + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char *command_names[] = {
+    "PAPER",
+    "MARGIN",
+    "HEADER",
+    "NUMBER",
+    "LINESPACE",
+    "FONT",
+    "HIGHLIGHT",
+    "TEXT",
+    "LINE",
+    "START",
+    "END",
+    "HIGHDEF",
+    "RUN",
+    "SPANS",
+    "PAGES",
+    "TITLE"
+};
+
+
+static void
+lexer_error(const char *format, ...)
+{
+    va_list ap;
+
+    flockfile(stderr);
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    funlockfile(stderr);
+
+    if (lexer_fail != NULL) {
+        lexer_fail();
+    }
+    exit(EXIT_FAILURE);
+}
+
+
+/* Map a regular file in the binary format read only.  Its strings are
+ * terminated in the file, so parsing does not write to the mapping.  The text format
+ * terminates every string in place, which would copy each page of a
+ * private mapping, so it is read instead.  Returns 0 when the input is
+ * not mapped. */
+static int
+map_input(struct Lexer *lx)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(lx->fd, &st) < 0 || !S_ISREG(st.st_mode)
+            || st.st_size <= LEXER_MAGIC_SIZE
+            || (off_t)(size_t)st.st_size != st.st_size) {
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, lx->fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (memcmp(map, LEXER_MAGIC, LEXER_MAGIC_SIZE) != 0) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    lx->buf = map;
+    lx->size = st.st_size;
+    lx->end = st.st_size;
+    lx->mapped = 1;
+
+    return 1;
+}
+
+
+/* Give back the pages of a mapped file before mark, which are not read
+ * again, so the resident size does not grow with the input. */
+static void
+release(struct Lexer *lx)
+{
+    size_t end;
+
+    end = lx->mark - lx->mark % LEXER_RELEASE;
+    if (end > lx->released) {
+        madvise(lx->buf + lx->released, end - lx->released, MADV_DONTNEED);
+        lx->released = end;
+    }
+}
+
+
+/* Read more input.  Bytes from mark are kept, moved to the head of the
+ * buffer, and the buffer is grown when mark is already at the head.
+ * Returns the number of bytes read, 0 at end of input. */
+static size_t
+fill(struct Lexer *lx)
+{
+    ssize_t n;
+
+    if (lx->mapped) {
+        return 0;
+    }
+
+    if (lx->mark > 0) {
+        memmove(lx->buf, lx->buf + lx->mark, lx->end - lx->mark);
+        lx->pos -= lx->mark;
+        lx->end -= lx->mark;
+        lx->mark = 0;
+    }
+
+    if (lx->end == lx->size) {
+        lx->size *= 2;
+        lx->buf = realloc(lx->buf, lx->size + 1);
+        if (lx->buf == NULL) {
+            lexer_error("out of memory");
+        }
+    }
+
+    do {
+        n = read(lx->fd, lx->buf + lx->end, lx->size - lx->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        lexer_error("read error");
+    }
+
+    lx->end += n;
+    lx->buf[lx->end] = '\0';
+
+    return n;
+}
+
+
+static int
+peek(struct Lexer *lx)
+{
+    if (lx->pos == lx->end && fill(lx) == 0) {
+        return EOF;
+    }
+    return (unsigned char)lx->buf[lx->pos];
+}
+
+
+static int
+next(struct Lexer *lx)
+{
+    if (lx->pos == lx->end && fill(lx) == 0) {
+        lexer_error("unexpected EOF");
+    }
+    return (unsigned char)lx->buf[lx->pos++];
+}
+
+
+static void
+skip_space(struct Lexer *lx)
+{
+    int c;
+
+    lx->mark = lx->pos;
+    for (;;) {
+        while (lx->pos < lx->end) {
+            c = lx->buf[lx->pos];
+            if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+                lx->mark = lx->pos;
+                return;
+            }
+            lx->pos++;
+        }
+        lx->mark = lx->pos;
+        if (fill(lx) == 0) {
+            return;
+        }
+    }
+}
+
+
+static int
+hexdigit(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+
+static unsigned long
+read_varint(struct Lexer *lx)
+{
+    unsigned long x = 0;
+    int shift = 0;
+    int c;
+
+    do {
+        c = next(lx);
+        if (shift >= 64) {
+            lexer_error("varint too long");
+        }
+        x |= (unsigned long)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return x;
+}
+
+
+static long
+read_zigzag(struct Lexer *lx)
+{
+    unsigned long x;
+
+    x = read_varint(lx);
+    return (long)(x >> 1) ^ -(long)(x & 1);
+}
+
+
+static enum Command
+keyword(const char *s, size_t len)
+{
+#define KEYWORD(name, command) \
+    if (len == sizeof(name) - 1 && memcmp(s, name, len) == 0) { \
+        return command; \
+    }
+
+    switch (s[0]) {
+    case 'E':
+        KEYWORD("END", COMMAND_END);
+        break;
+    case 'F':
+        KEYWORD("FONT", COMMAND_FONT);
+        break;
+    case 'H':
+        KEYWORD("HEADER", COMMAND_HEADER);
+        KEYWORD("HIGHDEF", COMMAND_HIGHDEF);
+        KEYWORD("HIGHLIGHT", COMMAND_HIGHLIGHT);
+        break;
+    case 'L':
+        KEYWORD("LINE", COMMAND_LINE);
+        KEYWORD("LINESPACE", COMMAND_LINESPACE);
+        break;
+    case 'M':
+        KEYWORD("MARGIN", COMMAND_MARGIN);
+        break;
+    case 'N':
+        KEYWORD("NUMBER", COMMAND_NUMBER);
+        break;
+    case 'P':
+        KEYWORD("PAGES", COMMAND_PAGES);
+        KEYWORD("PAPER", COMMAND_PAPER);
+        break;
+    case 'R':
+        KEYWORD("RUN", COMMAND_RUN);
+        break;
+    case 'S':
+        KEYWORD("SPANS", COMMAND_SPANS);
+        KEYWORD("START", COMMAND_START);
+        break;
+    case 'T':
+        KEYWORD("TEXT", COMMAND_TEXT);
+        KEYWORD("TITLE", COMMAND_TITLE);
+        break;
+    }
+
+#undef KEYWORD
+
+    lexer_error("unknown command: %.*s", (int)len, s);
+    return COMMAND_END;
+}
+
+
+/* path "-" reads standard input.  Input other than a binary file is
+ * consumed as it arrives, so a pipe or FIFO can be rendered while the
+ * writer is still producing it. */
+void
+lexer_open(struct Lexer *lx, const char *path)
+{
+    if (strcmp(path, "-") == 0) {
+        lx->fd = STDIN_FILENO;
+    } else {
+        lx->fd = open(path, O_RDONLY);
+    }
+    if (lx->fd < 0) {
+        lexer_error("cannot open: %s", path);
+    }
+
+    lx->pos = 0;
+    lx->end = 0;
+    lx->mark = 0;
+    lx->binary = 0;
+    lx->mapped = 0;
+    lx->released = 0;
+
+    if (!map_input(lx)) {
+        lx->size = LEXER_BUFSIZE;
+        lx->buf = malloc(lx->size + 1);
+        if (lx->buf == NULL) {
+            lexer_error("out of memory");
+        }
+        lx->buf[0] = '\0';
+    }
+
+    while (lx->end < LEXER_MAGIC_SIZE + 1) {
+        if (fill(lx) == 0) {
+            return;
+        }
+    }
+
+    if (memcmp(lx->buf, LEXER_MAGIC, LEXER_MAGIC_SIZE) == 0) {
+        if (lx->buf[LEXER_MAGIC_SIZE] != LEXER_VERSION) {
+            lexer_error("unsupported binary version: %d",
+                    lx->buf[LEXER_MAGIC_SIZE]);
+        }
+        lx->binary = 1;
+        lx->pos = LEXER_MAGIC_SIZE + 1;
+    }
+}
+
+
+void
+lexer_close(struct Lexer *lx)
+{
+    close(lx->fd);
+    if (lx->mapped) {
+        munmap(lx->buf, lx->size);
+    } else {
+        free(lx->buf);
+    }
+    lx->buf = NULL;
+}
+
+
+/* Skip white space and return non-zero at end of input. */
+int
+lexer_eof(struct Lexer *lx)
+{
+    if (!lx->binary) {
+        skip_space(lx);
+    }
+    lx->mark = lx->pos;
+    if (lx->mapped && lx->mark - lx->released >= LEXER_RELEASE) {
+        release(lx);
+    }
+    return (peek(lx) == EOF);
+}
+
+
+enum Command
+lexer_command(struct Lexer *lx)
+{
+    char name[COMMAND_MAX];
+    size_t len = 0;
+    int c;
+
+    if (lx->binary) {
+        lx->mark = lx->pos;
+        c = next(lx);
+        if (c >= (int)(sizeof(command_names) / sizeof(command_names[0]))) {
+            lexer_error("unknown opcode: %d", c);
+        }
+        return (enum Command)c;
+    }
+
+    skip_space(lx);
+    for (;;) {
+        c = peek(lx);
+        if (c < 'A' || c > 'Z') {
+            break;
+        }
+        if (len == COMMAND_MAX) {
+            lexer_error("unknown command: %.*s", (int)len, name);
+        }
+        name[len++] = c;
+        lx->pos++;
+    }
+
+    if (len == 0) {
+        lexer_error("read_command error");
+    }
+
+    return keyword(name, len);
+}
+
+
+const char *
+command_name(enum Command command)
+{
+    return command_names[command];
+}
+
+
+/* Whether the file at path starts like a dump: the magic of the binary
+ * format, or a command name and a space. */
+int
+lexer_probe(const char *path)
+{
+    char head[COMMAND_MAX + 8];
+    ssize_t len;
+    size_t n;
+    size_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, head, sizeof(head));
+    close(fd);
+    if (len < 0) {
+        return 0;
+    }
+
+    if (len >= LEXER_MAGIC_SIZE
+            && memcmp(head, LEXER_MAGIC, LEXER_MAGIC_SIZE) == 0) {
+        return 1;
+    }
+
+    for (n = 0; n < (size_t)len && head[n] >= 'A' && head[n] <= 'Z'; ++n) {
+    }
+    if (n == (size_t)len || (head[n] != ' ' && head[n] != '\n'
+                && head[n] != '\r' && head[n] != '\t')) {
+        return 0;
+    }
+    for (i = 0; i < sizeof(command_names) / sizeof(command_names[0]); ++i) {
+        if (strlen(command_names[i]) == n
+                && memcmp(head, command_names[i], n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Read a quoted string.  The result points into the input buffer and is
+ * valid until the next token is read.  Without escapes the string is not
+ * copied at all; escapes are resolved in place. */
+const char *
+lexer_string(struct Lexer *lx)
+{
+    size_t len;
+    long n;
+    int escaped;
+    int c;
+
+    if (lx->binary) {
+        lx->mark = lx->pos;
+        n = read_zigzag(lx);
+        if (n < 0) {
+            lexer_error("invalid string length: %ld", n);
+        }
+        len = n;
+        lx->mark = lx->pos;
+        while (lx->end - lx->pos < len + 1) {
+            if (fill(lx) == 0) {
+                lexer_error("unexpected EOF");
+            }
+        }
+        if (lx->buf[lx->pos + len] != '\0') {
+            lexer_error("string is not terminated");
+        }
+        lx->pos += len + 1;
+        return lx->buf + lx->mark;
+    }
+
+    skip_space(lx);
+    c = next(lx);
+    if (c != '"') {
+        lexer_error("unexpected character: %d", c);
+    }
+
+    lx->mark = lx->pos;
+    len = 0;
+    escaped = 0;
+    for (;;) {
+        c = next(lx);
+        if (c == '"') {
+            break;
+        }
+        if (c == '\\') {
+            c = next(lx);
+            escaped = 1;
+        }
+        if (escaped) {
+            lx->buf[lx->mark + len] = c;
+        }
+        len++;
+    }
+
+    lx->buf[lx->mark + len] = '\0';
+
+    return lx->buf + lx->mark;
+}
+
+
+int
+lexer_integer(struct Lexer *lx)
+{
+    int sign = 1;
+    int x = 0;
+    int c;
+
+    if (lx->binary) {
+        lx->mark = lx->pos;
+        return (int)read_zigzag(lx);
+    }
+
+    skip_space(lx);
+    c = peek(lx);
+    if (c == '-' || c == '+') {
+        sign = (c == '-') ? -1 : 1;
+        lx->pos++;
+        c = peek(lx);
+    }
+
+    if (c < '0' || c > '9') {
+        lexer_error("read_integer error");
+    }
+
+    while (c >= '0' && c <= '9') {
+        x = x * 10 + (c - '0');
+        lx->pos++;
+        c = peek(lx);
+    }
+
+    return sign * x;
+}
+
+
+/* strtod() in the C locale, whatever the locale of the backend is. */
+static double
+c_strtod(const char *s, size_t len)
+{
+    static __thread locale_t c_locale;
+    locale_t old;
+    char buf[NUMBER_MAX + 1];
+    double x;
+
+    if (len > NUMBER_MAX) {
+        lexer_error("number too long: %.*s", (int)len, s);
+    }
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    if (c_locale == (locale_t)0) {
+        c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+        if (c_locale == (locale_t)0) {
+            lexer_error("cannot create C locale");
+        }
+    }
+    old = uselocale(c_locale);
+    x = strtod(buf, NULL);
+    uselocale(old);
+
+    return x;
+}
+
+
+/* Parse a decimal number to the nearest double.  The digits make an
+ * integer mantissa and a decimal exponent, which are scaled once when
+ * both are exact doubles, as they are for the numbers of a dump.  Other
+ * numbers go to strtod(). */
+double
+lexer_float(struct Lexer *lx)
+{
+    uint64_t mantissa = 0;
+    double x;
+    int negative = 0;
+    int exact = 1;
+    int exp10 = 0;
+    int exp_sign;
+    int exp;
+    int digits = 0;
+    int c;
+
+    if (lx->binary) {
+        lx->mark = lx->pos;
+        return read_zigzag(lx) / 1000.0;
+    }
+
+    /* The number is kept in the buffer from mark for strtod(). */
+    skip_space(lx);
+    c = peek(lx);
+    if (c == '-' || c == '+') {
+        negative = (c == '-');
+        lx->pos++;
+        c = peek(lx);
+    }
+
+    while (c >= '0' && c <= '9') {
+        if (mantissa < MANTISSA_EXACT / 10) {
+            mantissa = mantissa * 10 + (c - '0');
+        } else {
+            exact = 0;
+        }
+        digits++;
+        lx->pos++;
+        c = peek(lx);
+    }
+
+    if (c == '.') {
+        lx->pos++;
+        c = peek(lx);
+        while (c >= '0' && c <= '9') {
+            if (mantissa < MANTISSA_EXACT / 10) {
+                mantissa = mantissa * 10 + (c - '0');
+                exp10--;
+            } else if (c != '0') {
+                exact = 0;
+            }
+            digits++;
+            lx->pos++;
+            c = peek(lx);
+        }
+    }
+
+    if (digits == 0) {
+        lexer_error("read_float error");
+    }
+
+    if (c == 'e' || c == 'E') {
+        lx->pos++;
+        c = peek(lx);
+        exp_sign = 1;
+        if (c == '-' || c == '+') {
+            exp_sign = (c == '-') ? -1 : 1;
+            lx->pos++;
+            c = peek(lx);
+        }
+        exp = 0;
+        while (c >= '0' && c <= '9') {
+            if (exp < 10000) {
+                exp = exp * 10 + (c - '0');
+            }
+            lx->pos++;
+            c = peek(lx);
+        }
+        exp10 += exp_sign * exp;
+    }
+
+    if (!exact || exp10 < -POWER_EXACT || exp10 > POWER_EXACT) {
+        return c_strtod(lx->buf + lx->mark, lx->pos - lx->mark);
+    }
+
+    if (exp10 < 0) {
+        x = (double)mantissa / powers_of_ten[-exp10];
+    } else {
+        x = (double)mantissa * powers_of_ten[exp10];
+    }
+    return negative ? -x : x;
+}
+
+
+/* Read #rrggbb and return it as 0xrrggbb. */
+unsigned long
+lexer_color(struct Lexer *lx)
+{
+    unsigned long rgb = 0;
+    int d;
+    int i;
+
+    if (lx->binary) {
+        lx->mark = lx->pos;
+        for (i = 0; i < 3; ++i) {
+            rgb = (rgb << 8) | next(lx);
+        }
+        return rgb;
+    }
+
+    skip_space(lx);
+    if (next(lx) != '#') {
+        lexer_error("read_color error");
+    }
+
+    for (i = 0; i < 6; ++i) {
+        d = hexdigit(next(lx));
+        if (d < 0) {
+            lexer_error("read_color error");
+        }
+        rgb = (rgb << 4) | d;
+    }
+
+    return rgb;
+}
@@ -0,0 +1,76 @@
+
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+
+
+/* The binary format starts with LEXER_MAGIC and a version byte.  Each
+ * command is an opcode byte, the value of enum Command, followed by its
+ * arguments:
+ *   integer  zigzag encoded LEB128
+ *   float    integer of the value multiplied by 1000
+ *   string   integer byte length, the UTF-8 bytes and a NUL
+ *   color    three bytes r g b
+ * Files without the magic are read as text. */
+#define LEXER_MAGIC "\0VPB"
+#define LEXER_MAGIC_SIZE 4
+#define LEXER_VERSION 1
+
+
+/* Commands of the intermediate format.  A backend handles the subset it
+ * supports.  The values are opcodes of the binary format, so new commands
+ * are only appended. */
+enum Command {
+    COMMAND_PAPER,
+    COMMAND_MARGIN,
+    COMMAND_HEADER,
+    COMMAND_NUMBER,
+    COMMAND_LINESPACE,
+    COMMAND_FONT,
+    COMMAND_HIGHLIGHT,
+    COMMAND_TEXT,
+    COMMAND_LINE,
+    COMMAND_START,
+    COMMAND_END,
+    COMMAND_HIGHDEF,
+    COMMAND_RUN,
+    COMMAND_SPANS,
+    COMMAND_PAGES,
+    COMMAND_TITLE
+};
+
+
+/* Buffered reader of the intermediate format.  Tokens are parsed straight
+ * out of buf.  A binary file is mapped whole, and pages before released
+ * have been given back.  Other input is read in large blocks, and the
+ * block is compacted when a token crosses its end. */
+struct Lexer {
+    int fd;
+    char *buf;
+    size_t size;
+    size_t pos;
+    size_t end;
+    size_t mark;
+    int binary;
+    int mapped;
+    size_t released;
+};
+
+
+/* Called after an error in the input is reported, when set, instead of
+ * exiting.  It must not return. */
+extern void (*lexer_fail)();
+
+void lexer_open(struct Lexer *lx, const char *path);
+void lexer_close(struct Lexer *lx);
+int lexer_eof(struct Lexer *lx);
+enum Command lexer_command(struct Lexer *lx);
+const char *command_name(enum Command command);
+int lexer_probe(const char *path);
+const char *lexer_string(struct Lexer *lx);
+int lexer_integer(struct Lexer *lx);
+double lexer_float(struct Lexer *lx);
+unsigned long lexer_color(struct Lexer *lx);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+
+static double now();
+
+
+__thread struct Stats stats;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "parse",
+    "layout",
+    "measure",
+    "draw",
+    "finish"
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "commands",
+    "runs",
+    "glyphs",
+    "pages",
+    "pages_kept",
+    "fills",
+    "font_switches",
+    "bytes",
+    "arena_allocs",
+    "arena_blocks"
+};
+
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Enable the timers.  The job starts parsing. */
+void
+stats_start()
+{
+    stats.enabled = 1;
+    stats.phase = PHASE_PARSE;
+    stats.mark = now();
+}
+
+
+enum Phase
+stats_switch(enum Phase phase)
+{
+    enum Phase prev;
+    double t;
+
+    t = now();
+    stats.time[stats.phase] += t - stats.mark;
+    stats.mark = t;
+    prev = stats.phase;
+    stats.phase = phase;
+    return prev;
+}
+
+
+/* A table for people or a JSON object on one line. */
+void
+stats_report(FILE *fp, int json)
+{
+    double total = 0;
+    int i;
+
+    stats_switch(stats.phase);
+    for (i = 0; i < PHASE_COUNT; ++i) {
+        total += stats.time[i];
+    }
+
+    if (json) {
+        fprintf(fp, "{");
+        for (i = 0; i < PHASE_COUNT; ++i) {
+            fprintf(fp, "\"%s\": %.6f, ", phase_names[i], stats.time[i]);
+        }
+        fprintf(fp, "\"total\": %.6f", total);
+        for (i = 0; i < COUNTER_COUNT; ++i) {
+            fprintf(fp, ", \"%s\": %lu", counter_names[i], stats.counters[i]);
+        }
+        fprintf(fp, "}\n");
+        return;
+    }
+
+    for (i = 0; i < PHASE_COUNT; ++i) {
+        fprintf(fp, "%-14s %10.3f s\n", phase_names[i], stats.time[i]);
+    }
+    fprintf(fp, "%-14s %10.3f s\n", "total", total);
+    for (i = 0; i < COUNTER_COUNT; ++i) {
+        fprintf(fp, "%-14s %10lu\n", counter_names[i], stats.counters[i]);
+    }
+}
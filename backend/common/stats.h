@@ -0,0 +1,63 @@
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+
+/* Phases of a print job.  Time is charged to the current phase, so a
+ * phase entered from another one is not counted twice. */
+enum Phase {
+    PHASE_PARSE,
+    PHASE_LAYOUT,
+    PHASE_MEASURE,
+    PHASE_DRAW,
+    PHASE_FINISH,
+    PHASE_COUNT
+};
+
+
+enum Counter {
+    COUNTER_COMMANDS,
+    COUNTER_RUNS,
+    COUNTER_GLYPHS,
+    COUNTER_PAGES,
+    /* Pages whose file is kept from the last run by --cache. */
+    COUNTER_PAGES_KEPT,
+    COUNTER_FILLS,
+    COUNTER_FONT_SWITCHES,
+    COUNTER_BYTES,
+    /* Allocations from arenas, and the blocks behind them, each a
+     * malloc. */
+    COUNTER_ARENA_ALLOCS,
+    COUNTER_ARENA_BLOCKS,
+    COUNTER_COUNT
+};
+
+
+/* Timers and counters reported by --stats.  Counters are always
+ * counted; timers only run when enabled.  Each thread has its own. */
+struct Stats {
+    int enabled;
+    enum Phase phase;
+    double mark;
+    double time[PHASE_COUNT];
+    unsigned long counters[COUNTER_COUNT];
+};
+
+
+extern __thread struct Stats stats;
+
+void stats_start();
+enum Phase stats_switch(enum Phase phase);
+void stats_report(FILE *fp, int json);
+
+/* Enter phase and return the previous one to go back to:
+ *   prev = STATS_PHASE(PHASE_LAYOUT);
+ *   ...
+ *   STATS_PHASE(prev); */
+#define STATS_PHASE(phase) (stats.enabled ? stats_switch(phase) : (phase))
+
+#define STATS_ADD(counter, n) (stats.counters[counter] += (n))
+
+#endif
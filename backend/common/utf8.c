@@ -0,0 +1,715 @@
+#include <string.h>
+
+#include "utf8.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define UTF8_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(UTF8_SSE2) && defined(__GNUC__)
+#define UTF8_SSSE3 1
+#define UTF8_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* Text with fewer bytes left is decoded a byte at a time.  Runs from
+ * source code are mostly short, and the ASCII decoders only slow them. */
+#define ASCII_BLOCK_MIN 32
+
+/* Shorter multi-byte text is decoded one sequence at a time, which is
+ * faster than validating it in vectors first. */
+#define MULTIBYTE_BLOCK_MIN 48
+
+/* Errors found by the vector validators from a byte, the one before it
+ * (prev1) and the high and low nibbles of prev1.  A pair is invalid when
+ * the lookups of all three share a bit.  Continuations missing after a
+ * three or four byte lead are found from the bytes two and three back. */
+#define TOO_SHORT      (1 << 0)        /* lead not followed by continuation */
+#define TOO_LONG       (1 << 1)        /* ASCII followed by continuation */
+#define OVERLONG_3     (1 << 2)        /* E0 80..9F */
+#define TOO_LARGE      (1 << 3)        /* F4 90..BF, F5..FF */
+#define SURROGATE      (1 << 4)        /* ED A0..BF */
+#define OVERLONG_2     (1 << 5)        /* C0, C1 */
+#define TOO_LARGE_1000 (1 << 6)        /* F5..FF 80..8F */
+#define OVERLONG_4     (1 << 6)        /* F0 80..8F */
+#define TWO_CONTS      ((char)0x80)    /* continuation after continuation */
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define PREV1_HIGH_TABLE \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define PREV1_LOW_TABLE \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define HIGH_TABLE \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 \
+        | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* The bits of a lead byte kept by the vector decoders, and the shift
+ * dropping the bits of the bytes after its sequence, by its high nibble.
+ * Continuation bytes never lead. */
+#define LEAD_BITS_TABLE \
+    0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, \
+    0, 0, 0, 0, 0x1F, 0x1F, 0x0F, 0x07
+
+#define LEAD_SHIFT_TABLE \
+    18, 18, 18, 18, 18, 18, 18, 18, \
+    0, 0, 0, 0, 12, 12, 6, 0
+
+
+typedef size_t (*AsciiDecoder)(const unsigned char *s, size_t len,
+        uint32_t *out);
+typedef int (*RunValidator)(const unsigned char *s, size_t len);
+typedef size_t (*RunDecoder)(const unsigned char *s, size_t len,
+        uint32_t *out);
+
+/* The decoders for the CPU.  The run decoders are missing without the
+ * byte shuffles of SSSE3; every sequence is then validated on its own. */
+struct Decoders {
+    AsciiDecoder ascii;
+    RunValidator validate;
+    RunDecoder decode;
+};
+
+static size_t ascii_scalar(const unsigned char *s, size_t len,
+        uint32_t *out);
+#ifdef UTF8_SSE2
+static size_t ascii_sse2(const unsigned char *s, size_t len, uint32_t *out);
+#endif
+#ifdef UTF8_AVX2
+static size_t ascii_avx2(const unsigned char *s, size_t len, uint32_t *out);
+#endif
+#ifdef UTF8_SSSE3
+static int validate_ssse3(const unsigned char *s, size_t len);
+static __m128i decode_lanes_ssse3(__m128i seqs);
+static size_t decode_ssse3(const unsigned char *s, size_t len,
+        uint32_t *out);
+static size_t decode_tail(const unsigned char *s, size_t len, uint32_t *out);
+#endif
+#ifdef UTF8_AVX2
+static int validate_avx2(const unsigned char *s, size_t len);
+static size_t decode_avx2(const unsigned char *s, size_t len, uint32_t *out);
+#endif
+static const struct Decoders *select_decoders();
+static size_t decode_sequence(const unsigned char *s, size_t len,
+        uint32_t *codepoint);
+
+
+#ifdef UTF8_SSE2
+static const struct Decoders sse2_decoders = {
+    ascii_sse2, NULL, NULL
+};
+#else
+static const struct Decoders scalar_decoders = {
+    ascii_scalar, NULL, NULL
+};
+#endif
+#ifdef UTF8_SSSE3
+static const struct Decoders ssse3_decoders = {
+    ascii_sse2, validate_ssse3, decode_ssse3
+};
+#endif
+#ifdef UTF8_AVX2
+static const struct Decoders avx2_decoders = {
+    ascii_avx2, validate_avx2, decode_avx2
+};
+#endif
+
+/* Set once, by whichever thread decodes first; all choices are equal. */
+static const struct Decoders *decoders;
+
+#ifdef UTF8_SSSE3
+/* Byte shuffles packing the 32-bit lanes set in the index to the front. */
+static const unsigned char pack_lanes[16][16] = {
+    { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x80, 0x80, 0x80, 0x80,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x04, 0x05, 0x06, 0x07, 0x80, 0x80, 0x80, 0x80,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x08, 0x09, 0x0A, 0x0B, 0x80, 0x80, 0x80, 0x80,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0A, 0x0B,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+      0x08, 0x09, 0x0A, 0x0B, 0x80, 0x80, 0x80, 0x80 },
+    { 0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x0C, 0x0D, 0x0E, 0x0F,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x04, 0x05, 0x06, 0x07, 0x0C, 0x0D, 0x0E, 0x0F,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+      0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80 },
+    { 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+      0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0A, 0x0B,
+      0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80 },
+    { 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+      0x0C, 0x0D, 0x0E, 0x0F, 0x80, 0x80, 0x80, 0x80 },
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+      0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F }
+};
+#endif
+
+
+/* The ASCII decoders copy the leading ASCII bytes of s to out, widened,
+ * and return their number.  Blocks are tested at once and bytes are only
+ * looked at one by one in the block holding the first non-ASCII byte. */
+static size_t
+ascii_scalar(const unsigned char *s, size_t len, uint32_t *out)
+{
+    uint64_t word;
+    size_t i = 0;
+    size_t j;
+
+    while (i + 8 <= len) {
+        memcpy(&word, s + i, 8);
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+        for (j = 0; j < 8; ++j) {
+            out[i + j] = s[i + j];
+        }
+        i += 8;
+    }
+    while (i < len && s[i] < 0x80) {
+        out[i] = s[i];
+        i++;
+    }
+    return i;
+}
+
+
+#ifdef UTF8_SSE2
+static size_t
+ascii_sse2(const unsigned char *s, size_t len, uint32_t *out)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes;
+    __m128i words;
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+        bytes = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(bytes) != 0) {
+            break;
+        }
+        words = _mm_unpacklo_epi8(bytes, zero);
+        _mm_storeu_si128((__m128i *)(out + i),
+                _mm_unpacklo_epi16(words, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 4),
+                _mm_unpackhi_epi16(words, zero));
+        words = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_si128((__m128i *)(out + i + 8),
+                _mm_unpacklo_epi16(words, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 12),
+                _mm_unpackhi_epi16(words, zero));
+        i += 16;
+    }
+    return i + ascii_scalar(s + i, len - i, out + i);
+}
+#endif
+
+
+#ifdef UTF8_AVX2
+__attribute__((target("avx2")))
+static size_t
+ascii_avx2(const unsigned char *s, size_t len, uint32_t *out)
+{
+    __m256i bytes;
+    __m128i half;
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        bytes = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (_mm256_movemask_epi8(bytes) != 0) {
+            break;
+        }
+        half = _mm256_castsi256_si128(bytes);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                _mm256_cvtepu8_epi32(half));
+        _mm256_storeu_si256((__m256i *)(out + i + 8),
+                _mm256_cvtepu8_epi32(_mm_srli_si128(half, 8)));
+        half = _mm256_extracti128_si256(bytes, 1);
+        _mm256_storeu_si256((__m256i *)(out + i + 16),
+                _mm256_cvtepu8_epi32(half));
+        _mm256_storeu_si256((__m256i *)(out + i + 24),
+                _mm256_cvtepu8_epi32(_mm_srli_si128(half, 8)));
+        i += 32;
+    }
+    /* The tail is legacy SSE code, which is slow after dirty upper
+     * halves of AVX registers. */
+    _mm256_zeroupper();
+    return i + ascii_sse2(s + i, len - i, out + i);
+}
+#endif
+
+
+#ifdef UTF8_SSSE3
+/* Return whether the len bytes at s are valid UTF-8, checking 16 bytes at
+ * once by looking up the errors of each byte pair in the tables above.
+ * The last block is padded with NULs, which end any sequence left open. */
+__attribute__((target("ssse3")))
+static int
+validate_ssse3(const unsigned char *s, size_t len)
+{
+    const __m128i prev1_high = _mm_setr_epi8(PREV1_HIGH_TABLE);
+    const __m128i prev1_low = _mm_setr_epi8(PREV1_LOW_TABLE);
+    const __m128i high = _mm_setr_epi8(HIGH_TABLE);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    unsigned char pad[16];
+    __m128i errors = _mm_setzero_si128();
+    __m128i prev = _mm_setzero_si128();
+    __m128i bytes;
+    __m128i prev1;
+    __m128i special;
+    __m128i must23;
+    size_t i;
+
+    for (i = 0; i <= len; i += 16) {
+        if (len - i >= 16) {
+            bytes = _mm_loadu_si128((const __m128i *)(s + i));
+        } else {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, s + i, len - i);
+            bytes = _mm_loadu_si128((const __m128i *)pad);
+        }
+
+        prev1 = _mm_alignr_epi8(bytes, prev, 15);
+        special = _mm_and_si128(_mm_and_si128(
+                _mm_shuffle_epi8(prev1_high,
+                    _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(prev1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(high,
+                    _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble)));
+        must23 = _mm_or_si128(
+                _mm_subs_epu8(_mm_alignr_epi8(bytes, prev, 14),
+                    _mm_set1_epi8(0xE0 - 0x80)),
+                _mm_subs_epu8(_mm_alignr_epi8(bytes, prev, 13),
+                    _mm_set1_epi8(0xF0 - 0x80)));
+        errors = _mm_or_si128(errors, _mm_xor_si128(special,
+                    _mm_and_si128(must23, _mm_set1_epi8((char)0x80))));
+        prev = bytes;
+    }
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128()))
+        == 0xFFFF;
+}
+
+
+/* Decode four lanes of the bytes spread as below.  Longer sequences
+ * have greater lead nibbles, so each test overrides the ones before. */
+__attribute__((target("ssse3")))
+static inline __m128i
+decode_lanes_ssse3(__m128i seqs)
+{
+    const __m128i lead_bits = _mm_setr_epi8(LEAD_BITS_TABLE);
+    __m128i high;
+    __m128i joined;
+    __m128i lead;
+    __m128i c;
+
+    high = _mm_and_si128(_mm_srli_epi32(seqs, 4), _mm_set1_epi32(0x0F));
+    seqs = _mm_and_si128(seqs, _mm_or_si128(_mm_shuffle_epi8(lead_bits,
+                    _mm_or_si128(high, _mm_set1_epi32(0x80808000))),
+                _mm_set1_epi32(0x3F3F3F00)));
+    joined = _mm_madd_epi16(_mm_maddubs_epi16(seqs,
+                _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+
+    c = _mm_srli_epi32(joined, 18);
+    lead = _mm_cmpgt_epi32(high, _mm_set1_epi32(0x0B));
+    c = _mm_or_si128(_mm_andnot_si128(lead, c),
+            _mm_and_si128(lead, _mm_srli_epi32(joined, 12)));
+    lead = _mm_cmpgt_epi32(high, _mm_set1_epi32(0x0D));
+    c = _mm_or_si128(_mm_andnot_si128(lead, c),
+            _mm_and_si128(lead, _mm_srli_epi32(joined, 6)));
+    lead = _mm_cmpeq_epi32(high, _mm_set1_epi32(0x0F));
+    return _mm_or_si128(_mm_andnot_si128(lead, c),
+            _mm_and_si128(lead, joined));
+}
+
+
+/* Decode the valid UTF-8 at s to out and return the number of
+ * codepoints.  Every byte of a block of eight is decoded as if it led a
+ * sequence: the four bytes from it are spread to a lane, the lead bits
+ * and those of the continuations are masked off, the six-bit groups are
+ * joined by multiplying and the lane is shifted right by the bits of the
+ * bytes past the sequence.  Lanes of continuation bytes are then packed
+ * out.  Blocks of ASCII are widened. */
+__attribute__((target("ssse3")))
+static size_t
+decode_ssse3(const unsigned char *s, size_t len, uint32_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i bytes;
+    __m128i words;
+    size_t n = 0;
+    size_t i = 0;
+    int keep;
+
+    while (i + 16 <= len) {
+        bytes = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(bytes) == 0) {
+            words = _mm_unpacklo_epi8(bytes, zero);
+            _mm_storeu_si128((__m128i *)(out + n),
+                    _mm_unpacklo_epi16(words, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 4),
+                    _mm_unpackhi_epi16(words, zero));
+            words = _mm_unpackhi_epi8(bytes, zero);
+            _mm_storeu_si128((__m128i *)(out + n + 8),
+                    _mm_unpacklo_epi16(words, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 12),
+                    _mm_unpackhi_epi16(words, zero));
+            i += 16;
+            n += 16;
+            continue;
+        }
+
+        keep = ~_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8((char)0xC0),
+                    bytes)) & 0xFF;
+        _mm_storeu_si128((__m128i *)(out + n), _mm_shuffle_epi8(
+                    decode_lanes_ssse3(_mm_shuffle_epi8(bytes,
+                            _mm_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4,
+                                2, 3, 4, 5, 3, 4, 5, 6))),
+                    _mm_loadu_si128((const __m128i *)pack_lanes[keep & 0xF])));
+        n += __builtin_popcount(keep & 0xF);
+        _mm_storeu_si128((__m128i *)(out + n), _mm_shuffle_epi8(
+                    decode_lanes_ssse3(_mm_shuffle_epi8(bytes,
+                            _mm_setr_epi8(4, 5, 6, 7, 5, 6, 7, 8,
+                                6, 7, 8, 9, 7, 8, 9, 10))),
+                    _mm_loadu_si128((const __m128i *)pack_lanes[keep >> 4])));
+        n += __builtin_popcount(keep >> 4);
+        i += 8;
+    }
+
+    return n + decode_tail(s + i, len - i, out + n);
+}
+#endif
+
+
+#ifdef UTF8_AVX2
+__attribute__((target("avx2")))
+static int
+validate_avx2(const unsigned char *s, size_t len)
+{
+    const __m256i prev1_high = _mm256_setr_epi8(PREV1_HIGH_TABLE,
+            PREV1_HIGH_TABLE);
+    const __m256i prev1_low = _mm256_setr_epi8(PREV1_LOW_TABLE,
+            PREV1_LOW_TABLE);
+    const __m256i high = _mm256_setr_epi8(HIGH_TABLE, HIGH_TABLE);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    unsigned char pad[32];
+    __m256i errors = _mm256_setzero_si256();
+    __m256i prev = _mm256_setzero_si256();
+    __m256i bytes;
+    __m256i carried;
+    __m256i prev1;
+    __m256i special;
+    __m256i must23;
+    size_t i;
+    int valid;
+
+    for (i = 0; i <= len; i += 32) {
+        if (len - i >= 32) {
+            bytes = _mm256_loadu_si256((const __m256i *)(s + i));
+        } else {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, s + i, len - i);
+            bytes = _mm256_loadu_si256((const __m256i *)pad);
+        }
+
+        /* Byte shifts work within each half; the halves before those of
+         * bytes are the upper one of prev and the lower one of bytes. */
+        carried = _mm256_permute2x128_si256(prev, bytes, 0x21);
+        prev1 = _mm256_alignr_epi8(bytes, carried, 15);
+        special = _mm256_and_si256(_mm256_and_si256(
+                _mm256_shuffle_epi8(prev1_high,
+                    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                _mm256_shuffle_epi8(prev1_low,
+                    _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(high,
+                    _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble)));
+        must23 = _mm256_or_si256(
+                _mm256_subs_epu8(_mm256_alignr_epi8(bytes, carried, 14),
+                    _mm256_set1_epi8(0xE0 - 0x80)),
+                _mm256_subs_epu8(_mm256_alignr_epi8(bytes, carried, 13),
+                    _mm256_set1_epi8(0xF0 - 0x80)));
+        errors = _mm256_or_si256(errors, _mm256_xor_si256(special,
+                    _mm256_and_si256(must23,
+                        _mm256_set1_epi8((char)0x80))));
+        prev = bytes;
+    }
+
+    valid = _mm256_testz_si256(errors, errors);
+    _mm256_zeroupper();
+    return valid;
+}
+
+
+/* As decode_ssse3(), eight bytes at a time, packing each half.  The
+ * lanes are shifted by the lead nibble in one step. */
+__attribute__((target("avx2")))
+static size_t
+decode_avx2(const unsigned char *s, size_t len, uint32_t *out)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4,
+            2, 3, 4, 5, 3, 4, 5, 6, 4, 5, 6, 7, 5, 6, 7, 8,
+            6, 7, 8, 9, 7, 8, 9, 10);
+    const __m256i lead_bits = _mm256_setr_epi8(LEAD_BITS_TABLE,
+            LEAD_BITS_TABLE);
+    const __m256i lead_shift = _mm256_setr_epi8(LEAD_SHIFT_TABLE,
+            LEAD_SHIFT_TABLE);
+    __m128i bytes;
+    __m256i seqs;
+    __m256i index;
+    __m256i joined;
+    __m256i c;
+    size_t n = 0;
+    size_t i = 0;
+    int keep;
+
+    while (i + 16 <= len) {
+        bytes = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(bytes) == 0) {
+            _mm256_storeu_si256((__m256i *)(out + n),
+                    _mm256_cvtepu8_epi32(bytes));
+            _mm256_storeu_si256((__m256i *)(out + n + 8),
+                    _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+            i += 16;
+            n += 16;
+            continue;
+        }
+
+        seqs = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(bytes),
+                spread);
+        index = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(seqs, 4),
+                    _mm256_set1_epi32(0x0F)), _mm256_set1_epi32(0x80808000));
+        seqs = _mm256_and_si256(seqs, _mm256_or_si256(
+                    _mm256_shuffle_epi8(lead_bits, index),
+                    _mm256_set1_epi32(0x3F3F3F00)));
+        joined = _mm256_madd_epi16(_mm256_maddubs_epi16(seqs,
+                    _mm256_set1_epi32(0x01400140)),
+                _mm256_set1_epi32(0x00011000));
+        c = _mm256_srlv_epi32(joined,
+                _mm256_shuffle_epi8(lead_shift, index));
+
+        keep = ~_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8((char)0xC0),
+                    bytes)) & 0xFF;
+        _mm_storeu_si128((__m128i *)(out + n), _mm_shuffle_epi8(
+                    _mm256_castsi256_si128(c), _mm_loadu_si128(
+                        (const __m128i *)pack_lanes[keep & 0xF])));
+        n += __builtin_popcount(keep & 0xF);
+        _mm_storeu_si128((__m128i *)(out + n), _mm_shuffle_epi8(
+                    _mm256_extracti128_si256(c, 1), _mm_loadu_si128(
+                        (const __m128i *)pack_lanes[keep >> 4])));
+        n += __builtin_popcount(keep >> 4);
+        i += 8;
+    }
+
+    _mm256_zeroupper();
+    return n + decode_tail(s + i, len - i, out + n);
+}
+#endif
+
+
+#ifdef UTF8_SSSE3
+/* Decode the end of a valid run left by the vector decoders.  Its first
+ * bytes may continue a sequence they have decoded already. */
+static size_t
+decode_tail(const unsigned char *s, size_t len, uint32_t *out)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+    while (i < len && (s[i] & 0xC0) == 0x80) {
+        i++;
+    }
+    while (i < len) {
+        if (s[i] < 0x80) {
+            out[n++] = s[i++];
+        } else {
+            i += decode_sequence(s + i, len - i, &out[n++]);
+        }
+    }
+    return n;
+}
+#endif
+
+
+static const struct Decoders *
+select_decoders()
+{
+#ifdef UTF8_SSSE3
+    __builtin_cpu_init();
+#endif
+#ifdef UTF8_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_decoders;
+    }
+#endif
+#ifdef UTF8_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        return &ssse3_decoders;
+    }
+#endif
+#ifdef UTF8_SSE2
+    return &sse2_decoders;
+#else
+    return &scalar_decoders;
+#endif
+}
+
+
+/* Decode the sequence at s, which starts with a non-ASCII byte, and
+ * return its length.  An invalid sequence, overlong, a surrogate or past
+ * U+10FFFF, decodes to U+FFFD and its longest valid prefix is skipped, at
+ * least one byte, as Unicode recommends. */
+static size_t
+decode_sequence(const unsigned char *s, size_t len, uint32_t *codepoint)
+{
+    uint32_t c;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    size_t need;
+    size_t i;
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        c = s[0] & 0x1F;
+        need = 1;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        c = s[0] & 0x0F;
+        need = 2;
+        if (s[0] == 0xE0) {
+            lo = 0xA0;
+        } else if (s[0] == 0xED) {
+            hi = 0x9F;
+        }
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        c = s[0] & 0x07;
+        need = 3;
+        if (s[0] == 0xF0) {
+            lo = 0x90;
+        } else if (s[0] == 0xF4) {
+            hi = 0x8F;
+        }
+    } else {
+        *codepoint = UTF8_REPLACEMENT;
+        return 1;
+    }
+
+    for (i = 1; i <= need; ++i) {
+        if (i >= len || s[i] < lo || s[i] > hi) {
+            *codepoint = UTF8_REPLACEMENT;
+            return i;
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+
+    *codepoint = c;
+    return need + 1;
+}
+
+
+/* Decode len bytes of text to codepoints, which has room for len of
+ * them, and return their number.  Long runs are decoded with the widest
+ * vectors of the CPU: the ASCII prefix is widened in blocks and the rest
+ * is validated as a whole and then decoded in blocks.  Runs that are not
+ * valid are decoded one sequence at a time, with U+FFFD for errors. */
+size_t
+utf8_decode(const char *text, size_t len, uint32_t *codepoints)
+{
+    const struct Decoders *cpu = decoders;
+    const unsigned char *s = (const unsigned char *)text;
+    size_t n = 0;
+    size_t i = 0;
+    size_t k;
+
+    if (cpu == NULL) {
+        cpu = select_decoders();
+        decoders = cpu;
+    }
+
+    if (len >= ASCII_BLOCK_MIN) {
+        i = n = cpu->ascii(s, len, codepoints);
+    }
+    if (cpu->validate != NULL && len - i >= MULTIBYTE_BLOCK_MIN
+            && cpu->validate(s + i, len - i)) {
+        return n + cpu->decode(s + i, len - i, codepoints + n);
+    }
+
+    while (i < len) {
+        if (s[i] >= 0x80) {
+            i += decode_sequence(s + i, len - i, &codepoints[n++]);
+        } else if (len - i >= ASCII_BLOCK_MIN) {
+            k = cpu->ascii(s + i, len - i, codepoints + n);
+            i += k;
+            n += k;
+        } else {
+            codepoints[n++] = s[i++];
+        }
+    }
+
+    return n;
+}
+
+
+/* Write codepoint to buf and return its length. */
+int
+utf8_encode(uint32_t codepoint, char *buf)
+{
+    unsigned char *p = (unsigned char *)buf;
+
+    if (codepoint < 0x80) {
+        p[0] = codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        p[0] = 0xC0 | (codepoint >> 6);
+        p[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    } else if (codepoint < 0x10000) {
+        p[0] = 0xE0 | (codepoint >> 12);
+        p[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        p[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    p[0] = 0xF0 | (codepoint >> 18);
+    p[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    p[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    p[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
@@ -0,0 +1,17 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define UTF8_REPLACEMENT 0xFFFD
+
+/* Longest sequence written by utf8_encode(), without a NUL. */
+#define UTF8_MAX 4
+
+
+size_t utf8_decode(const char *text, size_t len, uint32_t *codepoints);
+int utf8_encode(uint32_t codepoint, char *buf);
+
+#endif
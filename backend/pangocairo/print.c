@@ -4,16 +4,38 @@
 #include <string.h>
 #include <stdarg.h>
 #include <locale.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #include <cairo.h>
 #include <cairo-ps.h>
 #include <cairo-pdf.h>
 #include <pango/pangocairo.h>
 
+#include "lexer.h"
+#include "stats.h"
+
 
 /* FIXME: don't use constant */
 #define LINENR_MARGIN 10
 
+/* print_text() nests through newpage() and print_header(). */
+#define LAYOUT_POOL 4
+
+/* fg, bg, weight, style, underline */
+#define HIGHLIGHT_ATTRS 5
+
+/* Printable ASCII, drawn from glyphs shaped once with a fixed pitch
+ * font. */
+#define FAST_FIRST ' '
+#define FAST_LAST '~'
+#define FAST_COUNT (FAST_LAST - FAST_FIRST + 1)
+
+/* Sequences that fonts for code turn into ligatures or other contextual
+ * glyphs, shaped with printable ASCII to find such fonts. */
+#define LIGATURE_PROBE " -> => != == === <= >= <- :: ... // /* */ && || ++" \
+    " -- <> </ /> www ff fi fl ffi"
+
 
 struct Options {
     double paper_width;
@@ -27,13 +49,37 @@ struct Options {
     int number_width;
     char *font_name;
     double font_size;
+    int page_first;
+    int page_last;
+};
+
+
+/* Attributes of a highlight defined by HIGHDEF.  They are templates
+ * copied into the attribute list of each span.  A highlight of only a
+ * color and a variant is fast, and can be drawn by print_fast(). */
+struct Highlight {
+    PangoAttribute *attrs[HIGHLIGHT_ATTRS];
+    int num_attrs;
+    unsigned long fg;
+    int bold;
+    int italic;
+    int fast;
+};
+
+
+/* A highlight of bytes start to end of the text of SPANS. */
+struct Span {
+    struct Highlight *hi;
+    int start;
+    int end;
 };
 
 
-struct Color {
-    double r;
-    double g;
-    double b;
+/* Printable ASCII in a variant of a fixed pitch font as pango shapes it,
+ * one glyph advancing one cell per byte. */
+struct Variant {
+    PangoFont *font;
+    PangoGlyphInfo glyphs[FAST_COUNT];
 };
 
 
@@ -45,43 +91,69 @@ struct PrintContext {
     double numberwidth;
     double y;
     double x;
+    /* Width of a line, and advance of a fixed pitch font or 0, in pango
+     * units. */
+    int width;
+    int cell;
 };
 
 
 static int endswith(const char *haystack, const char *needle);
-static int utf8len(const char *str);
 static void error(const char *message, ...);
-static void skip_space();
-static int read_char();
-static char *read_command();
-static char *read_string();
-static int read_integer();
-static double read_float();
-static struct Color read_color();
 static void command_paper();
 static void command_margin();
 static void command_header();
 static void command_number();
 static void command_font();
+static void command_pages();
 static void command_line();
+static PangoAttribute *color_attr(
+        PangoAttribute *(*create)(guint16, guint16, guint16),
+        unsigned long rgb);
+static void command_highdef();
+static void command_spans();
 static void command_start();
 static void command_end();
+static void print_geometry();
+static PangoLayout *create_layout();
+static int shape_variant(struct Variant *variant, int bold, int italic);
+static void monospace_layout();
+static void free_variants();
 static void textsize(const char *text, double *width, double *height, double *baseline);
 static void newline();
 static void newpage();
+static int page_in_range(int pagenum);
 static void print_number();
 static void print_header();
-static void print_text(const char *text);
-static void print();
+static void print_text(const char *text, PangoAttrList *attrs);
+static int print_fast(const char *text, const struct Span *spans,
+        int count);
+static void draw_fast(const char *text, int start, int end,
+        const struct Highlight *hi);
+static int print();
 
 
 static char *infile;
 static char *outfile;
-static FILE *in;
+static struct Lexer lexer;
 static struct Options options;
 static struct PrintContext pc;
 static cairo_surface_t *surface;
 static cairo_t *cr;
+static PangoFontDescription *font_desc;
+static PangoLayout *measure_layout;
+static PangoLayout *layouts[LAYOUT_POOL];
+static int layout_depth;
+static double digit_width[10];
+static double space_width;
+static struct Highlight **highlights;
+static int highlights_size;
+static struct Span *spans;
+static int spans_size;
+static struct Variant variants[2][2];
+static PangoGlyphString *fast_glyphs;
+static int stats_json;
+static int geometry;
 
 
 static int
@@ -100,30 +172,6 @@ endswith(const char *haystack, const char *needle)
 }
 
 
-static int
-utf8len(const char *str)
-{
-    unsigned char c;
-
-    c = (unsigned char)str[0];
-    if ((c & 0x80) == 0) {
-        return 1;
-    } else if ((c & 0xE0) == 0xC0) {
-        return 2;
-    } else if ((c & 0xF0) == 0xE0) {
-        return 3;
-    } else if ((c & 0xF8) == 0xF0) {
-        return 4;
-    } else if ((c & 0xFC) == 0xF8) {
-        return 5;
-    } else if ((c & 0xFE) == 0xFC) {
-        return 6;
-    }
-
-    error("invalid utf8");
-}
-
-
 static void
 error(const char *format, ...)
 {
@@ -139,172 +187,230 @@ error(const char *format, ...)
 
 
 static void
-skip_space()
+command_paper()
 {
-    fscanf(in, "%*[ \t\r\n]");
+    options.paper_width = lexer_float(&lexer);
+    options.paper_height = lexer_float(&lexer);
 }
 
 
-static int
-read_char()
+static void
+command_margin()
 {
-    int c;
-
-    c = fgetc(in);
-    if (c == EOF) {
-        error("unexpected EOF");
-    }
-
-    return c;
+    options.margin_left = lexer_float(&lexer);
+    options.margin_top = lexer_float(&lexer);
+    options.margin_right = lexer_float(&lexer);
+    options.margin_bottom = lexer_float(&lexer);
 }
 
 
-static char *
-read_command()
+static void
+command_header()
 {
-    char buf[256];
-    int n;
-
-    n = fscanf(in, "%s", buf);
-    if (n != 1) {
-        error("read_command error");
-    }
-
-    return strdup(buf);
+    options.header_format = strdup(lexer_string(&lexer));
+    options.header_extraline = lexer_integer(&lexer);
 }
 
 
-static char *
-read_string()
+static void
+command_number()
 {
-    int c;
-    char *buf = NULL;
-    size_t bufsize = 0;
-
-    skip_space();
-    c = read_char();
-    if (c != '"') {
-        error("unexpected character: %d", c);
-    }
-
-    for (;;) {
-        bufsize += 1;
-        buf = realloc(buf, bufsize);
-        c = read_char();
-        if (c == '"') {
-            buf[bufsize - 1] = '\0';
-            break;
-        }
-        if (c == '\\') {
-            c = read_char();
-        }
-        buf[bufsize - 1] = c;
-    }
-
-    return buf;
+    options.number_width = lexer_integer(&lexer);
 }
 
 
-static int
-read_integer()
+static void
+command_font()
 {
-    int n;
-    int x;
-
-    n = fscanf(in, "%d", &x);
-    if (n != 1) {
-        error("read_integer error");
-    }
-
-    return x;
+    options.font_name = strdup(lexer_string(&lexer));
+    options.font_size = lexer_float(&lexer);
 }
 
 
-static double
-read_float()
+/* PAGES first last
+ * Only pages first to last are printed.  last 0 is the last page. */
+static void
+command_pages()
 {
-    int n;
-    double x;
-
-    n = fscanf(in, "%lf", &x);
-    if (n != 1) {
-        error("read_float error");
+    options.page_first = lexer_integer(&lexer);
+    options.page_last = lexer_integer(&lexer);
+    if (options.page_first < 1 || options.page_last < 0
+            || (options.page_last != 0
+                && options.page_last < options.page_first)) {
+        error("invalid page range: %d %d",
+                options.page_first, options.page_last);
     }
-
-    return x;
 }
 
 
-static struct Color
-read_color()
+static void
+command_line()
 {
-    int n;
-    int r, g, b;
-    struct Color color;
+    const char *text;
 
-    skip_space();
-    n = fscanf(in, "#%2x%2x%2x", &r, &g, &b);
-    if (n != 3) {
-        error("read_color error");
-    }
-
-    color.r = r / 255.0;
-    color.g = g / 255.0;
-    color.b = b / 255.0;
-
-    return color;
+    text = lexer_string(&lexer);
+    STATS_ADD(COUNTER_RUNS, 1);
+    newline();
+    print_text(text, NULL);
 }
 
 
-static void
-command_paper()
+static PangoAttribute *
+color_attr(PangoAttribute *(*create)(guint16, guint16, guint16),
+        unsigned long rgb)
 {
-    options.paper_width = read_float();
-    options.paper_height = read_float();
+    return create(((rgb >> 16) & 0xFF) * 0x101, ((rgb >> 8) & 0xFF) * 0x101,
+            (rgb & 0xFF) * 0x101);
 }
 
 
 static void
-command_margin()
+command_highdef()
 {
-    options.margin_left = read_float();
-    options.margin_top = read_float();
-    options.margin_right = read_float();
-    options.margin_bottom = read_float();
-}
-
+    struct Highlight *hi;
+    unsigned long fg;
+    unsigned long bg;
+    int bold;
+    int italic;
+    int underline;
+    int undercurl;
+    int id;
+
+    id = lexer_integer(&lexer);
+    if (id < 0) {
+        error("invalid highlight id: %d", id);
+    }
+    lexer_string(&lexer);
+    fg = lexer_color(&lexer);
+    bg = lexer_color(&lexer);
+    lexer_color(&lexer);
+    bold = lexer_integer(&lexer);
+    italic = lexer_integer(&lexer);
+    underline = lexer_integer(&lexer);
+    undercurl = lexer_integer(&lexer);
+
+    if (id >= highlights_size) {
+        int size = (highlights_size == 0) ? 256 : highlights_size;
+        while (size <= id) {
+            size *= 2;
+        }
+        highlights = realloc(highlights, sizeof(highlights[0]) * size);
+        if (highlights == NULL) {
+            error("out of memory");
+        }
+        memset(highlights + highlights_size, 0,
+                sizeof(highlights[0]) * (size - highlights_size));
+        highlights_size = size;
+    }
 
-static void
-command_header()
-{
-    options.header_format = read_string();
-    options.header_extraline = read_integer();
+    hi = highlights[id];
+    if (hi == NULL) {
+        hi = malloc(sizeof(*hi));
+        if (hi == NULL) {
+            error("out of memory");
+        }
+        highlights[id] = hi;
+    } else {
+        while (hi->num_attrs > 0) {
+            pango_attribute_destroy(hi->attrs[--hi->num_attrs]);
+        }
+    }
+    hi->num_attrs = 0;
+    hi->fg = fg;
+    hi->bold = bold;
+    hi->italic = italic;
+    hi->fast = (bg == 0xFFFFFF && !underline && !undercurl);
+
+    hi->attrs[hi->num_attrs++] = color_attr(pango_attr_foreground_new, fg);
+    if (bg != 0xFFFFFF) {
+        hi->attrs[hi->num_attrs++] = color_attr(pango_attr_background_new, bg);
+    }
+    if (bold) {
+        hi->attrs[hi->num_attrs++] = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
+    }
+    if (italic) {
+        hi->attrs[hi->num_attrs++] = pango_attr_style_new(PANGO_STYLE_ITALIC);
+    }
+    if (undercurl) {
+        hi->attrs[hi->num_attrs++] =
+            pango_attr_underline_new(PANGO_UNDERLINE_ERROR);
+    } else if (underline) {
+        hi->attrs[hi->num_attrs++] =
+            pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
+    }
 }
 
 
+/* SPANS count [id start end]... text
+ * start and end are byte offsets in text.  text comes last so that it is
+ * used in place. */
 static void
-command_number()
+command_spans()
 {
-    options.number_width = read_integer();
-}
+    PangoAttrList *attrs;
+    PangoAttribute *attr;
+    struct Highlight *hi;
+    const char *text;
+    int count;
+    int id;
+    int start;
+    int end;
+    int max_end;
+    int i;
+    int j;
 
+    max_end = 0;
 
-static void
-command_font()
-{
-    options.font_name = read_string();
-    options.font_size = read_float();
-}
+    count = lexer_integer(&lexer);
+    if (count > spans_size) {
+        spans_size = count;
+        spans = realloc(spans, sizeof(spans[0]) * spans_size);
+        if (spans == NULL) {
+            error("out of memory");
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        id = lexer_integer(&lexer);
+        start = lexer_integer(&lexer);
+        end = lexer_integer(&lexer);
+        if (id < 0 || id >= highlights_size || highlights[id] == NULL) {
+            error("undefined highlight id: %d", id);
+        }
+        if (start < 0 || end < start) {
+            error("invalid span: %d %d", start, end);
+        }
+        if (end > max_end) {
+            max_end = end;
+        }
+        spans[i].hi = highlights[id];
+        spans[i].start = start;
+        spans[i].end = end;
+    }
 
-static void
-command_line()
-{
-    char *text;
+    text = lexer_string(&lexer);
+    if ((size_t)max_end > strlen(text)) {
+        error("span is out of text: %d", max_end);
+    }
+    STATS_ADD(COUNTER_RUNS, count);
 
-    text = read_string();
     newline();
-    print_text(text);
-    free(text);
+    if (print_fast(text, spans, count)) {
+        return;
+    }
+
+    attrs = pango_attr_list_new();
+    for (i = 0; i < count; ++i) {
+        hi = spans[i].hi;
+        for (j = 0; j < hi->num_attrs; ++j) {
+            attr = pango_attribute_copy(hi->attrs[j]);
+            attr->start_index = spans[i].start;
+            attr->end_index = spans[i].end;
+            pango_attr_list_insert(attrs, attr);
+        }
+    }
+    print_text(text, attrs);
+
+    pango_attr_list_unref(attrs);
 }
 
 
@@ -314,8 +420,14 @@ command_start()
     double width;
     double height;
     double baseline;
+    char digit[2] = {0};
+    int i;
 
-    if (endswith(outfile, ".ps")) {
+    /* Without a file the surface is only measured with. */
+    if (geometry) {
+        surface = cairo_pdf_surface_create(NULL,
+                options.paper_width, options.paper_height);
+    } else if (endswith(outfile, ".ps")) {
         surface = cairo_ps_surface_create(outfile,
                 options.paper_width, options.paper_height);
     } else if (endswith(outfile, ".pdf")) {
@@ -330,6 +442,13 @@ command_start()
     pc.pagenum = 0;
     pc.linenum = 0;
 
+    font_desc = pango_font_description_new();
+    pango_font_description_set_family(font_desc, options.font_name);
+    pango_font_description_set_size(font_desc,
+            options.font_size * PANGO_SCALE);
+    measure_layout = create_layout();
+    layout_depth = 0;
+
     textsize("MW", &width, NULL, NULL);
     width = width / 2;
 
@@ -354,13 +473,44 @@ command_start()
     } else {
         pc.numberwidth = 0;
     }
+    pc.width = (options.paper_width - options.margin_left
+            - options.margin_right - pc.numberwidth) * PANGO_SCALE;
+
+    monospace_layout();
+
+    /* Line numbers are only digits and padding. */
+    for (i = 0; i < 10; ++i) {
+        digit[0] = '0' + i;
+        textsize(digit, &digit_width[i], NULL, NULL);
+    }
+    textsize(" ", &space_width, NULL, NULL);
 }
 
 
 static void
 command_end()
 {
-    cairo_show_page(cr);
+    struct stat st;
+    enum Phase prev;
+    int i;
+
+    if (page_in_range(pc.pagenum)) {
+        prev = STATS_PHASE(PHASE_DRAW);
+        cairo_show_page(cr);
+        STATS_PHASE(prev);
+    }
+
+    for (i = 0; i < LAYOUT_POOL; ++i) {
+        if (layouts[i] != NULL) {
+            g_object_unref(layouts[i]);
+            layouts[i] = NULL;
+        }
+    }
+    g_object_unref(measure_layout);
+    measure_layout = NULL;
+    free_variants();
+    pango_font_description_free(font_desc);
+    font_desc = NULL;
 
     if (cr != NULL) {
         cairo_destroy(cr);
@@ -368,25 +518,180 @@ command_end()
     }
 
     if (surface != NULL) {
+        prev = STATS_PHASE(PHASE_FINISH);
         cairo_surface_finish(surface);
         cairo_surface_destroy(surface);
         surface = NULL;
+        STATS_PHASE(prev);
+
+        if (stat(outfile, &st) == 0) {
+            STATS_ADD(COUNTER_BYTES, st.st_size);
+        }
     }
 }
 
 
+/* Rows of a page as newline() fills it, and the columns of a fixed pitch
+ * font (0 for others) that a line holds at least, for a dumper bounding
+ * the lines of a page range. */
 static void
-textsize(const char *text, double *width, double *height, double *baseline)
+print_geometry()
+{
+    double limit = options.paper_height - options.margin_bottom;
+    double y;
+    int rows = 1;
+
+    y = options.margin_top + pc.font_height * (1 + options.header_extraline);
+    for (y += pc.font_height; y + pc.font_height <= limit;
+            y += pc.font_height) {
+        rows += 1;
+    }
+    printf("%d %d\n", rows, (pc.cell > 0) ? pc.width / pc.cell : 0);
+}
+
+
+static PangoLayout *
+create_layout()
 {
     PangoLayout *layout;
-    PangoFontDescription *desc;
-    int w, h;
 
     layout = pango_cairo_create_layout(cr);
-    desc = pango_font_description_new();
-    pango_font_description_set_family(desc, options.font_name);
-    pango_font_description_set_size(desc, options.font_size * PANGO_SCALE);
-    pango_layout_set_font_description(layout, desc);
+    pango_layout_set_font_description(layout, font_desc);
+
+    return layout;
+}
+
+
+/* Shape printable ASCII and the ligature probe in a variant as one run
+ * of the font.  Returns the advance of its glyphs, or 0 when they are not
+ * one glyph of one advance per byte, the same wherever a byte is. */
+static int
+shape_variant(struct Variant *variant, int bold, int italic)
+{
+    char text[FAST_COUNT + sizeof(LIGATURE_PROBE)];
+    PangoLayout *layout;
+    PangoAttrList *attrs;
+    PangoLayoutLine *line;
+    PangoGlyphItem *run;
+    PangoGlyphInfo *glyph;
+    int seen[FAST_COUNT] = {0};
+    int cell = 0;
+    int c;
+    int i;
+
+    for (i = 0; i < FAST_COUNT; ++i) {
+        text[i] = FAST_FIRST + i;
+    }
+    strcpy(text + FAST_COUNT, LIGATURE_PROBE);
+
+    layout = create_layout();
+    attrs = pango_attr_list_new();
+    if (bold) {
+        pango_attr_list_insert(attrs,
+                pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+    }
+    if (italic) {
+        pango_attr_list_insert(attrs,
+                pango_attr_style_new(PANGO_STYLE_ITALIC));
+    }
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_set_attributes(layout, attrs);
+    pango_attr_list_unref(attrs);
+
+    line = pango_layout_get_line_readonly(layout, 0);
+    if (line == NULL || line->runs == NULL || line->runs->next != NULL) {
+        g_object_unref(layout);
+        return 0;
+    }
+    run = line->runs->data;
+    if (run->glyphs->num_glyphs != (int)strlen(text)) {
+        g_object_unref(layout);
+        return 0;
+    }
+
+    for (i = 0; i < run->glyphs->num_glyphs; ++i) {
+        glyph = &run->glyphs->glyphs[i];
+        c = text[i] - FAST_FIRST;
+        if (i == 0) {
+            cell = glyph->geometry.width;
+        }
+        if (run->glyphs->log_clusters[i] != i
+                || (glyph->glyph & PANGO_GLYPH_UNKNOWN_FLAG)
+                || glyph->geometry.width != cell
+                || glyph->geometry.x_offset != 0
+                || glyph->geometry.y_offset != 0
+                || (seen[c] && glyph->glyph != variant->glyphs[c].glyph)) {
+            cell = 0;
+            break;
+        }
+        variant->glyphs[c] = *glyph;
+        seen[c] = 1;
+    }
+
+    if (cell > 0) {
+        variant->font = g_object_ref(run->item->analysis.font);
+    }
+    g_object_unref(layout);
+    return cell;
+}
+
+
+/* A font is fixed pitch when pango shapes printable ASCII of every variant
+ * to glyphs of one cell.  Text of only these glyphs that fits a line is
+ * then drawn from them by print_fast(). */
+static void
+monospace_layout()
+{
+    int bold;
+    int italic;
+    int cell;
+
+    pc.cell = 0;
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            cell = shape_variant(&variants[bold][italic], bold, italic);
+            if (cell <= 0 || (pc.cell != 0 && cell != pc.cell)) {
+                pc.cell = 0;
+                free_variants();
+                return;
+            }
+            pc.cell = cell;
+        }
+    }
+
+    fast_glyphs = pango_glyph_string_new();
+}
+
+
+static void
+free_variants()
+{
+    int bold;
+    int italic;
+
+    for (bold = 0; bold < 2; ++bold) {
+        for (italic = 0; italic < 2; ++italic) {
+            if (variants[bold][italic].font != NULL) {
+                g_object_unref(variants[bold][italic].font);
+                variants[bold][italic].font = NULL;
+            }
+        }
+    }
+    if (fast_glyphs != NULL) {
+        pango_glyph_string_free(fast_glyphs);
+        fast_glyphs = NULL;
+    }
+}
+
+
+static void
+textsize(const char *text, double *width, double *height, double *baseline)
+{
+    PangoLayout *layout = measure_layout;
+    int w, h;
+    enum Phase prev;
+
+    prev = STATS_PHASE(PHASE_MEASURE);
     pango_layout_set_markup(layout, text, -1);
     pango_layout_get_size(layout, &w, &h);
     if (width != NULL) {
@@ -398,14 +703,16 @@ textsize(const char *text, double *width, double *height, double *baseline)
     if (baseline != NULL) {
         *baseline = (double)pango_layout_get_baseline(layout) / PANGO_SCALE;
     }
-    pango_font_description_free(desc);
-    g_object_unref(layout);
+    STATS_PHASE(prev);
 }
 
 
 static void
 newline()
 {
+    enum Phase prev;
+
+    prev = STATS_PHASE(PHASE_LAYOUT);
     if (pc.linenum == 0) {
         newpage();
     } else {
@@ -420,17 +727,25 @@ newline()
     print_number();
 
     pc.x = options.margin_left + pc.numberwidth;
+    STATS_PHASE(prev);
 }
 
 
 static void
 newpage()
 {
-    if (pc.pagenum != 0) {
+    enum Phase prev;
+
+    if (pc.pagenum != 0 && page_in_range(pc.pagenum)) {
+        prev = STATS_PHASE(PHASE_DRAW);
         cairo_show_page(cr);
+        STATS_PHASE(prev);
     }
 
     pc.pagenum += 1;
+    if (page_in_range(pc.pagenum)) {
+        STATS_ADD(COUNTER_PAGES, 1);
+    }
 
     print_header();
 
@@ -439,11 +754,23 @@ newpage()
 }
 
 
+static int
+page_in_range(int pagenum)
+{
+    if (options.page_first == 0) {
+        return 1;
+    }
+    return pagenum >= options.page_first
+        && (options.page_last == 0 || pagenum <= options.page_last);
+}
+
+
 static void
 print_number()
 {
     char fmt[256];
     char buf[256];
+    char *p;
     double width;
 
     if (options.number_width <= 0) {
@@ -453,9 +780,12 @@ print_number()
     sprintf(fmt, "%%%dd", options.number_width);
     sprintf(buf, fmt, pc.linenum);
 
-    textsize(buf, &width, NULL, NULL);
+    width = 0;
+    for (p = buf; *p != '\0'; ++p) {
+        width += (*p == ' ') ? space_width : digit_width[*p - '0'];
+    }
     pc.x = options.margin_left + pc.numberwidth - LINENR_MARGIN - width;
-    print_text(buf);
+    print_text(buf, NULL);
 }
 
 
@@ -497,32 +827,51 @@ print_header()
 
     pc.x = options.margin_left;
     pc.y = options.margin_top;
-    print_text(left);
+    print_text(left, NULL);
 
     textsize(right, &width, NULL, NULL);
     pc.x = options.paper_width - options.margin_right - width;
     pc.y = options.margin_top;
-    print_text(right);
+    print_text(right, NULL);
 }
 
 
+/* text is markup when attrs is NULL.  Lines on pages out of the range are
+ * laid out for the page breaks, but not drawn. */
 static void
-print_text(const char *text)
+print_text(const char *text, PangoAttrList *attrs)
 {
     PangoLayout *layout;
-    PangoFontDescription *desc;
     PangoLayoutLine *line;
+    GSList *run;
+    enum Phase prev;
     int i;
 
-    layout = pango_cairo_create_layout(cr);
-    desc = pango_font_description_new();
-    pango_font_description_set_family(desc, options.font_name);
-    pango_font_description_set_size(desc, options.font_size * PANGO_SCALE);
-    pango_layout_set_font_description(layout, desc);
-    pango_layout_set_markup(layout, text, -1);
-    pango_layout_set_width(layout, (options.paper_width - options.margin_left
-                - options.margin_right - pc.numberwidth) * PANGO_SCALE);
-    pango_layout_set_wrap(layout, PANGO_WRAP_CHAR);
+    /* Nothing after the range changes the printed pages. */
+    if (options.page_last != 0 && pc.pagenum > options.page_last) {
+        return;
+    }
+    if (attrs == NULL && print_fast(text, NULL, 0)) {
+        return;
+    }
+
+    if (layout_depth == LAYOUT_POOL) {
+        error("print_text nested too deeply");
+    }
+    if (layouts[layout_depth] == NULL) {
+        layouts[layout_depth] = create_layout();
+        pango_layout_set_width(layouts[layout_depth], pc.width);
+        pango_layout_set_wrap(layouts[layout_depth], PANGO_WRAP_CHAR);
+    }
+    layout = layouts[layout_depth++];
+
+    prev = STATS_PHASE(PHASE_LAYOUT);
+    if (attrs == NULL) {
+        pango_layout_set_markup(layout, text, -1);
+    } else {
+        pango_layout_set_text(layout, text, -1);
+        pango_layout_set_attributes(layout, attrs);
+    }
 
     for (i = 0; i < pango_layout_get_line_count(layout); ++i) {
         line = pango_layout_get_line_readonly(layout, i);
@@ -533,64 +882,255 @@ print_text(const char *text)
                 options.paper_height - options.margin_bottom) {
             newpage();
         }
+        if (!page_in_range(pc.pagenum)) {
+            continue;
+        }
+        STATS_PHASE(PHASE_DRAW);
         cairo_move_to(cr, pc.x, pc.y + pc.font_height - pc.font_descent);
         pango_cairo_show_layout_line(cr, line);
+        STATS_PHASE(PHASE_LAYOUT);
+
+        /* Glyphs are only counted when asked for. */
+        if (stats.enabled) {
+            for (run = line->runs; run != NULL; run = run->next) {
+                STATS_ADD(COUNTER_GLYPHS,
+                        ((PangoGlyphItem *)run->data)->glyphs->num_glyphs);
+            }
+        }
     }
 
-    pango_font_description_free(desc);
-    g_object_unref(layout);
+    STATS_PHASE(prev);
+    layout_depth--;
 }
 
 
+/* Print text of printable ASCII fitting a line in a fixed pitch font
+ * without a layout, as print_text() would.  Spans must be in order and
+ * fast, and markup must be plain text.  The line cannot wrap, so the
+ * glyphs shaped by monospace_layout() are placed by column.  Returns 0
+ * when the text is left to print_text(). */
+static int
+print_fast(const char *text, const struct Span *spans, int count)
+{
+    enum Phase prev;
+    size_t len;
+    size_t i;
+    int start;
+    int k;
+    unsigned char c;
+
+    if (pc.cell == 0) {
+        return 0;
+    }
+    len = strlen(text);
+    if (len > (size_t)(pc.width / pc.cell)) {
+        return 0;
+    }
+    for (i = 0; i < len; ++i) {
+        c = (unsigned char)text[i];
+        if (c < FAST_FIRST || c > FAST_LAST
+                || (spans == NULL && (c == '<' || c == '&'))) {
+            return 0;
+        }
+    }
+    start = 0;
+    for (k = 0; k < count; ++k) {
+        if (spans[k].start < start || !spans[k].hi->fast) {
+            return 0;
+        }
+        start = spans[k].end;
+    }
+
+    /* Nothing after the range changes the printed pages. */
+    if (options.page_last != 0 && pc.pagenum > options.page_last) {
+        return 1;
+    }
+
+    prev = STATS_PHASE(PHASE_LAYOUT);
+    if (pc.y + pc.font_height >
+            options.paper_height - options.margin_bottom) {
+        newpage();
+    }
+    if (page_in_range(pc.pagenum)) {
+        STATS_PHASE(PHASE_DRAW);
+        start = 0;
+        for (k = 0; k < count; ++k) {
+            draw_fast(text, start, spans[k].start, NULL);
+            draw_fast(text, spans[k].start, spans[k].end, spans[k].hi);
+            start = spans[k].end;
+        }
+        draw_fast(text, start, len, NULL);
+        STATS_ADD(COUNTER_GLYPHS, len);
+    }
+
+    STATS_PHASE(prev);
+    return 1;
+}
+
+
+/* Draw bytes start to end of the line as the run of a layout in the
+ * variant and color of hi, or in the defaults for NULL.  The glyphs are
+ * offset from the start of the line like the run, so that they are
+ * placed at the same positions. */
 static void
+draw_fast(const char *text, int start, int end, const struct Highlight *hi)
+{
+    struct Variant *variant;
+    PangoGlyphItem run;
+    PangoItem item;
+    int i;
+
+    if (start == end) {
+        return;
+    }
+
+    variant = &variants[hi != NULL && hi->bold][hi != NULL && hi->italic];
+    pango_glyph_string_set_size(fast_glyphs, end - start);
+    for (i = 0; i < end - start; ++i) {
+        fast_glyphs->glyphs[i] = variant->glyphs[text[start + i] - FAST_FIRST];
+        fast_glyphs->glyphs[i].geometry.x_offset = start * pc.cell;
+        fast_glyphs->log_clusters[i] = i;
+    }
+
+    memset(&item, 0, sizeof(item));
+    item.offset = start;
+    item.length = end - start;
+    item.num_chars = end - start;
+    item.analysis.font = variant->font;
+    memset(&run, 0, sizeof(run));
+    run.item = &item;
+    run.glyphs = fast_glyphs;
+
+    cairo_save(cr);
+    if (hi != NULL) {
+        cairo_set_source_rgb(cr,
+                ((hi->fg >> 16) & 0xFF) * 0x101 / 65535.,
+                ((hi->fg >> 8) & 0xFF) * 0x101 / 65535.,
+                (hi->fg & 0xFF) * 0x101 / 65535.);
+    }
+    cairo_move_to(cr, pc.x, pc.y + pc.font_height - pc.font_descent);
+    pango_cairo_show_glyph_item(cr, text, &run);
+    cairo_restore(cr);
+}
+
+
+/* Returns 1 when --geometry stopped it at START. */
+static int
 print()
 {
-    char *command;
+    enum Command command;
 
-    for (;;) {
-        skip_space();
-        if (feof(in)) {
-            break;
-        }
-        command = read_command();
-        if (strcmp(command, "PAPER") == 0) {
+    while (!lexer_eof(&lexer)) {
+        command = lexer_command(&lexer);
+        STATS_ADD(COUNTER_COMMANDS, 1);
+        switch (command) {
+        case COMMAND_PAPER:
             command_paper();
-        } else if (strcmp(command, "MARGIN") == 0) {
+            break;
+        case COMMAND_MARGIN:
             command_margin();
-        } else if (strcmp(command, "HEADER") == 0) {
+            break;
+        case COMMAND_HEADER:
             command_header();
-        } else if (strcmp(command, "NUMBER") == 0) {
+            break;
+        case COMMAND_NUMBER:
             command_number();
-        } else if (strcmp(command, "FONT") == 0) {
+            break;
+        case COMMAND_FONT:
             command_font();
-        } else if (strcmp(command, "LINE") == 0) {
+            break;
+        case COMMAND_PAGES:
+            command_pages();
+            break;
+        case COMMAND_LINE:
             command_line();
-        } else if (strcmp(command, "START") == 0) {
+            break;
+        case COMMAND_HIGHDEF:
+            command_highdef();
+            break;
+        case COMMAND_SPANS:
+            command_spans();
+            break;
+        case COMMAND_START:
             command_start();
-        } else if (strcmp(command, "END") == 0) {
+            if (geometry) {
+                return 1;
+            }
+            break;
+        case COMMAND_END:
             command_end();
-        } else {
-            error("unknown command: %s", command);
+            break;
+        default:
+            error("unknown command: %s", command_name(command));
         }
-        free(command);
     }
+    return 0;
 }
 
 
 int
 main(int argc, char **argv)
 {
-    infile = argv[1];
-    outfile = argv[2];
+    static const struct option long_options[] = {
+        {"stats", optional_argument, NULL, 's'},
+        {"geometry", no_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0}
+    };
+    int started;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            if (optarg != NULL && strcmp(optarg, "json") != 0) {
+                error("unknown stats format: %s", optarg);
+            }
+            stats_json = (optarg != NULL);
+            stats_start();
+            break;
+        case 'g':
+            geometry = 1;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind != (geometry ? 1 : 2)) {
+        error("usage: %s [--stats[=json]] infile outfile\n"
+                "       %s --geometry infile\n"
+                "infile \"-\" reads the commands from standard input.\n"
+                "--stats reports the time of each phase and counters"
+                " when done,\n"
+                "   as a table or with =json as a JSON object.\n"
+                "--geometry prints the rows of a page and the columns of a"
+                " fixed pitch\n"
+                "   font (0 for others) when infile reaches START.",
+                argv[0], argv[0]);
+    }
+
+    infile = argv[optind];
+    outfile = geometry ? NULL : argv[optind + 1];
 
     setlocale(LC_ALL, "");
 
-    in = fopen(infile, "r");
+    lexer_open(&lexer, infile);
+
+    started = print();
+
+    lexer_close(&lexer);
 
-    print();
+    if (geometry) {
+        if (!started) {
+            error("no START in %s", infile);
+        }
+        print_geometry();
+    }
 
-    fclose(in);
+    if (stats.enabled) {
+        stats_report(stderr, stats_json);
+    }
 
     return 0;
 }
-
@@ -0,0 +1,823 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "lexer.h"
+
+/* Synthetic corpus generator and benchmark of the backends.
+ *
+ * Each corpus is written once per input format: name.run has HIGHDEF and
+ * RUN for backend/cairo, name.spans has HIGHDEF and SPANS for
+ * backend/pangocairo.  Both are also written in the binary format as
+ * name.run.bin and name.spans.bin.  Every backend prints every corpus of
+ * its format, as text and as binary, with --stats=json and a JSON object
+ * per run, holding the statistics of the backend, is written to standard
+ * output. */
+
+/* Longest statistics line of a backend. */
+#define STATS_MAX 4096
+
+/* Longest generated line in bytes. */
+#define LINE_MAX_BYTES 8192
+
+/* Runs of a line. */
+#define RUNS_MAX 4096
+
+enum Format {
+    FORMAT_RUN,
+    FORMAT_SPANS
+};
+
+
+enum HighlightId {
+    HI_NORMAL = 1,
+    HI_COMMENT,
+    HI_STATEMENT,
+    HI_STRING,
+    HI_TYPE,
+    HI_NUMBER,
+    HI_SEARCH,
+    HI_ERROR,
+    HI_MAX
+};
+
+
+struct Run {
+    int id;
+    int start;
+    int end;
+};
+
+
+/* A generated line: text and the highlight runs covering it. */
+struct Line {
+    char text[LINE_MAX_BYTES + 8];
+    int len;
+    struct Run runs[RUNS_MAX];
+    int num_runs;
+};
+
+
+struct Corpus {
+    const char *name;
+    int lines;
+    int dark;
+    void (*generate)(struct Line *line);
+};
+
+
+struct Backend {
+    const char *name;
+    const char *path;
+    enum Format format;
+};
+
+
+/* Commands are written as text lines, or as opcodes and encoded arguments
+ * after LEXER_MAGIC. */
+struct Writer {
+    FILE *fp;
+    int binary;
+    int started;
+};
+
+
+static void error(const char *format, ...);
+static unsigned long random_next();
+static int random_int(int n);
+static void line_add(struct Line *line, int id, const char *text);
+static void line_add_codepoint(struct Line *line, int id,
+        unsigned long codepoint);
+static void generate_code(struct Line *line);
+static void generate_cjk(struct Line *line);
+static void generate_wrap(struct Line *line);
+static void generate_highlights(struct Line *line);
+static void generate_dark(struct Line *line);
+static void put_command(struct Writer *w, enum Command command);
+static void put_varint(struct Writer *w, long n);
+static void put_integer(struct Writer *w, long n);
+static void put_float(struct Writer *w, double x);
+static void put_string(struct Writer *w, const char *text, int len);
+static void put_color(struct Writer *w, unsigned long rgb);
+static void write_highdef(struct Writer *w, int id, int dark);
+static void write_corpus(const struct Corpus *corpus, enum Format format,
+        int binary, const char *path);
+static double now();
+static long file_size(const char *path);
+static int read_stats(const char *path, char *buf, size_t size);
+static void bench(const struct Backend *backend, const struct Corpus *corpus,
+        int binary, const char *dir, int repeat);
+
+static const struct Corpus corpora[] = {
+    {"code", 20000, 0, generate_code},
+    {"cjk", 5000, 0, generate_cjk},
+    {"wrap", 1000, 0, generate_wrap},
+    {"highlights", 10000, 0, generate_highlights},
+    {"dark", 20000, 1, generate_dark},
+};
+
+static const char *keywords[] = {
+    "if", "else", "for", "while", "return", "switch", "case", "break",
+};
+
+static const char *types[] = {
+    "int", "char", "double", "static", "struct", "const", "void",
+};
+
+static const char *words[] = {
+    "page", "font", "glyph", "lexer", "highlight", "options", "width",
+    "height", "text", "len", "x", "y", "i", "count", "surface", "run",
+};
+
+static unsigned long random_state = 1;
+
+
+static void
+error(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+
+    exit(EXIT_FAILURE);
+}
+
+
+/* xorshift, so the corpus is the same on every machine. */
+static unsigned long
+random_next()
+{
+    random_state ^= (random_state << 13) & 0xFFFFFFFFUL;
+    random_state ^= random_state >> 17;
+    random_state ^= (random_state << 5) & 0xFFFFFFFFUL;
+    return random_state;
+}
+
+
+static int
+random_int(int n)
+{
+    return (int)(random_next() % n);
+}
+
+
+/* Text is appended to the last run when it has the same highlight. */
+static void
+line_add(struct Line *line, int id, const char *text)
+{
+    struct Run *run;
+    int len;
+
+    len = strlen(text);
+    if (line->len + len > LINE_MAX_BYTES) {
+        return;
+    }
+    memcpy(line->text + line->len, text, len);
+
+    run = (line->num_runs > 0) ? &line->runs[line->num_runs - 1] : NULL;
+    if (run != NULL && run->id == id) {
+        run->end += len;
+    } else if (line->num_runs < RUNS_MAX) {
+        run = &line->runs[line->num_runs++];
+        run->id = id;
+        run->start = line->len;
+        run->end = line->len + len;
+    } else {
+        return;
+    }
+    line->len += len;
+    line->text[line->len] = '\0';
+}
+
+
+static void
+line_add_codepoint(struct Line *line, int id, unsigned long codepoint)
+{
+    char buf[5];
+
+    if (codepoint < 0x80) {
+        buf[0] = codepoint;
+        buf[1] = '\0';
+    } else if (codepoint < 0x800) {
+        buf[0] = 0xC0 | (codepoint >> 6);
+        buf[1] = 0x80 | (codepoint & 0x3F);
+        buf[2] = '\0';
+    } else {
+        buf[0] = 0xE0 | (codepoint >> 12);
+        buf[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        buf[2] = 0x80 | (codepoint & 0x3F);
+        buf[3] = '\0';
+    }
+    line_add(line, id, buf);
+}
+
+
+/* C-like source: indentation, keywords, strings, numbers and comments
+ * within 80 columns. */
+static void
+generate_code(struct Line *line)
+{
+    char buf[32];
+    int indent;
+    int i;
+
+    if (random_int(8) == 0) {
+        return;
+    }
+
+    indent = random_int(4) * 4;
+    for (i = 0; i < indent; ++i) {
+        line_add(line, HI_NORMAL, " ");
+    }
+
+    if (random_int(6) == 0) {
+        line_add(line, HI_COMMENT, "/* ");
+        while (line->len < 70) {
+            line_add(line, HI_COMMENT, words[random_int(16)]);
+            line_add(line, HI_COMMENT, " ");
+        }
+        line_add(line, HI_COMMENT, "*/");
+        return;
+    }
+
+    if (random_int(3) == 0) {
+        line_add(line, HI_STATEMENT, keywords[random_int(8)]);
+        line_add(line, HI_NORMAL, " (");
+    } else {
+        line_add(line, HI_TYPE, types[random_int(7)]);
+        line_add(line, HI_NORMAL, " ");
+    }
+    while (line->len < 40 + random_int(30)) {
+        switch (random_int(4)) {
+        case 0:
+            line_add(line, HI_STRING, "\"");
+            line_add(line, HI_STRING, words[random_int(16)]);
+            line_add(line, HI_STRING, "\\n\"");
+            break;
+        case 1:
+            sprintf(buf, "%d", random_int(100000));
+            line_add(line, HI_NUMBER, buf);
+            break;
+        default:
+            line_add(line, HI_NORMAL, words[random_int(16)]);
+            break;
+        }
+        line_add(line, HI_NORMAL, random_int(2) ? ", " : " + ");
+    }
+    line_add(line, HI_NORMAL, ");");
+}
+
+
+/* Mixed ASCII, kana and CJK ideographs of double width. */
+static void
+generate_cjk(struct Line *line)
+{
+    int cells;
+    int id;
+
+    cells = 0;
+    while (cells < 60 + random_int(20)) {
+        id = random_int(5) == 0 ? HI_COMMENT : HI_NORMAL;
+        switch (random_int(4)) {
+        case 0:
+            line_add(line, id, words[random_int(16)]);
+            cells += 4;
+            break;
+        case 1:
+            line_add_codepoint(line, id, 0x3041 + random_int(0x56));
+            cells += 2;
+            break;
+        default:
+            line_add_codepoint(line, id, 0x4E00 + random_int(0x5000));
+            cells += 2;
+            break;
+        }
+    }
+}
+
+
+/* Lines of several hundred to a few thousand bytes that wrap. */
+static void
+generate_wrap(struct Line *line)
+{
+    int len;
+
+    len = 500 + random_int(3000);
+    while (line->len < len) {
+        line_add(line, random_int(4) ? HI_NORMAL : HI_STRING,
+                words[random_int(16)]);
+        line_add(line, HI_NORMAL, " ");
+    }
+}
+
+
+/* A highlight change every one to three characters. */
+static void
+generate_highlights(struct Line *line)
+{
+    char buf[4];
+    int id;
+    int n;
+
+    while (line->len < 78) {
+        id = HI_NORMAL + random_int(HI_MAX - HI_NORMAL);
+        for (n = 1 + random_int(3); n > 0; --n) {
+            buf[0] = '!' + random_int(94);
+            buf[1] = '\0';
+            if (buf[0] == '"' || buf[0] == '\\') {
+                buf[0] = 'x';
+            }
+            line_add(line, id, buf);
+        }
+    }
+}
+
+
+/* Code on a dark Normal background with search matches. */
+static void
+generate_dark(struct Line *line)
+{
+    int i;
+
+    generate_code(line);
+    if (line->num_runs > 2 && random_int(4) == 0) {
+        i = 1 + random_int(line->num_runs - 1);
+        line->runs[i].id = HI_SEARCH;
+    }
+}
+
+
+/* A text command starts a line, so the previous one is ended first. */
+static void
+put_command(struct Writer *w, enum Command command)
+{
+    if (w->binary) {
+        fputc(command, w->fp);
+    } else {
+        if (w->started) {
+            fputc('\n', w->fp);
+        }
+        fputs(command_name(command), w->fp);
+        w->started = 1;
+    }
+}
+
+
+/* zigzag encoded LEB128 */
+static void
+put_varint(struct Writer *w, long n)
+{
+    unsigned long x;
+
+    x = ((unsigned long)n << 1) ^ (unsigned long)(n >> (sizeof(long) * 8 - 1));
+    while (x >= 0x80) {
+        fputc((int)(x & 0x7F) | 0x80, w->fp);
+        x >>= 7;
+    }
+    fputc((int)x, w->fp);
+}
+
+
+static void
+put_integer(struct Writer *w, long n)
+{
+    if (w->binary) {
+        put_varint(w, n);
+    } else {
+        fprintf(w->fp, " %ld", n);
+    }
+}
+
+
+static void
+put_float(struct Writer *w, double x)
+{
+    if (w->binary) {
+        put_varint(w, (long)(x * 1000 + (x < 0 ? -0.5 : 0.5)));
+    } else {
+        fprintf(w->fp, " %.1f", x);
+    }
+}
+
+
+static void
+put_string(struct Writer *w, const char *text, int len)
+{
+    int i;
+
+    if (w->binary) {
+        put_varint(w, len);
+        fwrite(text, 1, len, w->fp);
+        fputc('\0', w->fp);
+        return;
+    }
+
+    fputs(" \"", w->fp);
+    for (i = 0; i < len; ++i) {
+        if (text[i] == '"' || text[i] == '\\') {
+            fputc('\\', w->fp);
+        }
+        fputc(text[i], w->fp);
+    }
+    fputc('"', w->fp);
+}
+
+
+static void
+put_color(struct Writer *w, unsigned long rgb)
+{
+    if (w->binary) {
+        fputc((int)(rgb >> 16) & 0xFF, w->fp);
+        fputc((int)(rgb >> 8) & 0xFF, w->fp);
+        fputc((int)rgb & 0xFF, w->fp);
+    } else {
+        fprintf(w->fp, " #%06lx", rgb);
+    }
+}
+
+
+static void
+write_highdef(struct Writer *w, int id, int dark)
+{
+    static const char *names[] = {
+        NULL, "Normal", "Comment", "Statement", "String", "Type", "Number",
+        "Search", "Error",
+    };
+    unsigned long fg;
+    unsigned long bg;
+    int bold = 0;
+    int italic = 0;
+    int undercurl = 0;
+
+    fg = dark ? 0xd0d0d0 : 0x000000;
+    bg = dark ? 0x1c1c1c : 0xffffff;
+    switch (id) {
+    case HI_COMMENT:
+        fg = 0x0000c0;
+        italic = 1;
+        break;
+    case HI_STATEMENT:
+        fg = 0xa52a2a;
+        bold = 1;
+        break;
+    case HI_STRING:
+        fg = 0xc000c0;
+        break;
+    case HI_TYPE:
+        fg = 0x2e8b57;
+        bold = 1;
+        break;
+    case HI_NUMBER:
+        fg = 0xc00000;
+        break;
+    case HI_SEARCH:
+        fg = 0x000000;
+        bg = 0xffff00;
+        break;
+    case HI_ERROR:
+        undercurl = 1;
+        break;
+    }
+    put_command(w, COMMAND_HIGHDEF);
+    put_integer(w, id);
+    put_string(w, names[id], strlen(names[id]));
+    put_color(w, fg);
+    put_color(w, bg);
+    put_color(w, 0xff0000);
+    put_integer(w, bold);
+    put_integer(w, italic);
+    put_integer(w, 0);
+    put_integer(w, undercurl);
+}
+
+
+static void
+write_corpus(const struct Corpus *corpus, enum Format format, int binary,
+        const char *path)
+{
+    static struct Line line;
+    const struct Run *run;
+    struct Writer w;
+    char header[256];
+    int lnum;
+    int id;
+    int i;
+
+    w.fp = fopen(path, "wb");
+    if (w.fp == NULL) {
+        error("cannot write: %s", path);
+    }
+    w.binary = binary;
+    w.started = 0;
+    if (binary) {
+        fwrite(LEXER_MAGIC, 1, LEXER_MAGIC_SIZE, w.fp);
+        fputc(LEXER_VERSION, w.fp);
+    }
+
+    put_command(&w, COMMAND_PAPER);
+    put_float(&w, 595.0);
+    put_float(&w, 842.0);
+    put_command(&w, COMMAND_MARGIN);
+    for (i = 0; i < 4; ++i) {
+        put_float(&w, 25.0);
+    }
+    put_command(&w, COMMAND_HEADER);
+    snprintf(header, sizeof(header), "%s%%=Page %%N", corpus->name);
+    put_string(&w, header, strlen(header));
+    put_integer(&w, 1);
+    put_command(&w, COMMAND_NUMBER);
+    put_integer(&w, 6);
+    if (format == FORMAT_RUN) {
+        put_command(&w, COMMAND_LINESPACE);
+        put_float(&w, 2.0);
+        put_command(&w, COMMAND_FONT);
+        put_string(&w, "Courier", 7);
+        put_float(&w, 10.0);
+    } else {
+        put_command(&w, COMMAND_FONT);
+        put_string(&w, "Monospace", 9);
+        put_float(&w, 6.0);
+    }
+    for (id = HI_NORMAL; id < HI_MAX; ++id) {
+        write_highdef(&w, id, corpus->dark);
+    }
+    put_command(&w, COMMAND_START);
+
+    random_state = 1;
+    for (lnum = 0; lnum < corpus->lines; ++lnum) {
+        line.len = 0;
+        line.num_runs = 0;
+        line.text[0] = '\0';
+        corpus->generate(&line);
+
+        if (format == FORMAT_RUN) {
+            put_command(&w, COMMAND_LINE);
+            for (i = 0; i < line.num_runs; ++i) {
+                run = &line.runs[i];
+                put_command(&w, COMMAND_RUN);
+                put_integer(&w, run->id);
+                put_string(&w, line.text + run->start,
+                        run->end - run->start);
+            }
+        } else {
+            put_command(&w, COMMAND_SPANS);
+            put_integer(&w, line.num_runs);
+            for (i = 0; i < line.num_runs; ++i) {
+                run = &line.runs[i];
+                put_integer(&w, run->id);
+                put_integer(&w, run->start);
+                put_integer(&w, run->end);
+            }
+            put_string(&w, line.text, line.len);
+        }
+    }
+
+    put_command(&w, COMMAND_END);
+    if (!binary) {
+        fputc('\n', w.fp);
+    }
+    if (fclose(w.fp) != 0) {
+        error("cannot write: %s", path);
+    }
+}
+
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static long
+file_size(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+
+/* The last JSON object the backend wrote to standard error. */
+static int
+read_stats(const char *path, char *buf, size_t size)
+{
+    FILE *fp;
+    char line[STATS_MAX];
+    int found = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '{') {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(buf, size, "%s", line);
+            found = 1;
+        }
+    }
+    fclose(fp);
+
+    return found;
+}
+
+
+/* The best of repeat runs is reported, with the peak RSS of that run.  A
+ * binary corpus is mapped by the backend instead of read. */
+static void
+bench(const struct Backend *backend, const struct Corpus *corpus,
+        int binary, const char *dir, int repeat)
+{
+    const char *ext = binary ? ".bin" : "";
+    char infile[4096];
+    char outfile[4096];
+    char statsfile[4096];
+    char stats[STATS_MAX] = "";
+    const char *p;
+    struct rusage usage;
+    double best = -1;
+    double start;
+    double wall;
+    long max_rss = 0;
+    pid_t pid;
+    int status = 0;
+    int pages = 0;
+    int fd;
+    int i;
+
+    snprintf(infile, sizeof(infile), "%s/%s.%s%s", dir, corpus->name,
+            (backend->format == FORMAT_RUN) ? "run" : "spans", ext);
+    snprintf(outfile, sizeof(outfile), "%s/%s.%s%s.pdf", dir, corpus->name,
+            backend->name, ext);
+    snprintf(statsfile, sizeof(statsfile), "%s/%s.%s%s.stats", dir,
+            corpus->name, backend->name, ext);
+
+    for (i = 0; i < repeat; ++i) {
+        start = now();
+        pid = fork();
+        if (pid < 0) {
+            error("fork failed");
+        }
+        if (pid == 0) {
+            fd = open(statsfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd >= 0) {
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+            execl(backend->path, backend->path, "--stats=json",
+                    infile, outfile, (char *)NULL);
+            fprintf(stderr, "cannot run: %s\n", backend->path);
+            _exit(127);
+        }
+        if (wait4(pid, &status, 0, &usage) < 0) {
+            error("wait4 failed");
+        }
+        wall = now() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            break;
+        }
+        if (best < 0 || wall < best) {
+            best = wall;
+            max_rss = usage.ru_maxrss;
+            if (!read_stats(statsfile, stats, sizeof(stats))) {
+                stats[0] = '\0';
+            }
+        }
+    }
+
+    printf("{\"backend\": \"%s\", \"corpus\": \"%s\", \"input\": \"%s\", ",
+            backend->name, corpus->name, binary ? "binary" : "text");
+    if (best < 0) {
+        printf("\"error\": \"exit status %d\"}\n",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return;
+    }
+    p = strstr(stats, "\"pages\": ");
+    if (p != NULL) {
+        pages = atoi(p + 9);
+    }
+    printf("\"input_bytes\": %ld, \"wall\": %.6f, ",
+            file_size(infile), best);
+    printf("\"pages\": %d, \"pages_per_sec\": %.2f, ",
+            pages, pages / best);
+    printf("\"max_rss_kb\": %ld, \"output_bytes\": %ld, ",
+            max_rss, file_size(outfile));
+    printf("\"stats\": %s}\n", (stats[0] != '\0') ? stats : "null");
+    fflush(stdout);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    struct Backend *backends;
+    const char *dir = "corpus";
+    const char *only = NULL;
+    char path[4096];
+    char *eq;
+    int num_backends;
+    int repeat = 3;
+    int binary;
+    int c;
+    int i;
+    int j;
+
+    while ((c = getopt(argc, argv, "c:d:r:")) != -1) {
+        switch (c) {
+        case 'c':
+            only = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - optind < 1 || repeat < 1) {
+        error("usage: %s [-d dir] [-r repeat] [-c corpus] name=backend...\n"
+                "Writes the corpus to dir (default: corpus) and prints a"
+                " JSON object per\n"
+                "backend and corpus.  name is cairo or pangocairo, which"
+                " selects the input\n"
+                "format.  Each corpus is run as text and as binary.\n"
+                "-r runs each one repeat times and reports the"
+                " best (default: 3).\n"
+                "-c only runs the named corpus.",
+                argv[0]);
+    }
+
+    num_backends = argc - optind;
+    backends = calloc(num_backends, sizeof(struct Backend));
+    if (backends == NULL) {
+        error("out of memory");
+    }
+    for (i = 0; i < num_backends; ++i) {
+        eq = strchr(argv[optind + i], '=');
+        if (eq == NULL) {
+            error("expected name=backend: %s", argv[optind + i]);
+        }
+        *eq = '\0';
+        backends[i].name = argv[optind + i];
+        backends[i].path = eq + 1;
+        if (strcmp(backends[i].name, "cairo") == 0) {
+            backends[i].format = FORMAT_RUN;
+        } else if (strcmp(backends[i].name, "pangocairo") == 0) {
+            backends[i].format = FORMAT_SPANS;
+        } else {
+            error("unknown backend: %s", backends[i].name);
+        }
+    }
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        error("cannot create: %s", dir);
+    }
+
+    for (j = 0; j < (int)(sizeof(corpora) / sizeof(corpora[0])); ++j) {
+        if (only != NULL && strcmp(only, corpora[j].name) != 0) {
+            continue;
+        }
+        for (binary = 0; binary < 2; ++binary) {
+            snprintf(path, sizeof(path), "%s/%s.run%s", dir,
+                    corpora[j].name, binary ? ".bin" : "");
+            write_corpus(&corpora[j], FORMAT_RUN, binary, path);
+            snprintf(path, sizeof(path), "%s/%s.spans%s", dir,
+                    corpora[j].name, binary ? ".bin" : "");
+            write_corpus(&corpora[j], FORMAT_SPANS, binary, path);
+        }
+
+        for (i = 0; i < num_backends; ++i) {
+            for (binary = 0; binary < 2; ++binary) {
+                bench(&backends[i], &corpora[j], binary, dir, repeat);
+            }
+        }
+    }
+
+    free(backends);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+" Prints each sample twice with {'cache': 1}, changing it in between, and
+" compares the dumps with ones printed without the cache.
+"
+"   vim -N -u NONE -i NONE -es -S syntax_cache.vim
+
+let s:dir = expand('<sfile>:p:h')
+execute 'set runtimepath^=' . fnameescape(fnamemodify(s:dir, ':h'))
+syntax on
+
+let s:samples = {}
+
+let s:samples.c = {
+      \ 'filetype': 'c',
+      \ 'lines': [
+      \   '/* A comment',
+      \   '   over lines "with a string" */',
+      \   'int main(void)',
+      \   '{',
+      \   '    char *s = "/* not a comment";',
+      \   '    return 0; /* done */',
+      \   '}',
+      \ ],
+      \ 'change': [5, '    char *s = "/* still not a comment";'],
+      \ }
+
+" Two regions of one group that end at different text.
+let s:samples.regions = {
+      \ 'syntax': [
+      \   'syntax region printA start=/<</ end=/>>/',
+      \   'syntax region printA start=/{{/ end=/}}/',
+      \   'highlight printA ctermfg=1 guifg=#c00000',
+      \ ],
+      \ 'lines': ['<<', 'a }} b >> c', '{{', 'a }} b >> c', '}}'],
+      \ 'change': [1, '<< '],
+      \ }
+
+" A nextgroup pending at the end of a line.
+let s:samples.skipnl = {
+      \ 'syntax': [
+      \   'syntax match printKey /^key$/ nextgroup=printValue skipnl',
+      \   'syntax match printValue /\w\+/ contained',
+      \   'highlight printValue ctermfg=2 guifg=#008000',
+      \ ],
+      \ 'lines': ['key', 'value', 'other', 'value'],
+      \ 'change': [3, 'others'],
+      \ }
+
+function! s:open(sample)
+  enew!
+  call setline(1, a:sample.lines)
+  if has_key(a:sample, 'filetype')
+    execute 'setfiletype' a:sample.filetype
+  else
+    syntax clear
+    for cmd in a:sample.syntax
+      execute cmd
+    endfor
+  endif
+endfunction
+
+function! s:dump(out, opts)
+  call print#cairo#dump(a:out, {}, a:opts)
+  return readfile(a:out)
+endfunction
+
+function! s:check(name, sample)
+  let out = tempname()
+  call s:open(a:sample)
+  let expected = s:dump(out, {})
+  call assert_equal(expected, s:dump(out, {'cache': 1}),
+        \ a:name . ': without a cache file')
+  call assert_equal(expected, s:dump(out, {'cache': 1}),
+        \ a:name . ': with the cache of the same text')
+  call setline(a:sample.change[0], a:sample.change[1])
+  let expected = s:dump(out, {})
+  call assert_equal(expected, s:dump(out, {'cache': 1}),
+        \ a:name . ': with the cache of the text before a change')
+  call delete(out)
+  call delete(out . '.cache')
+endfunction
+
+for s:name in sort(keys(s:samples))
+  call s:check(s:name, s:samples[s:name])
+endfor
+
+if !empty(v:errors)
+  call writefile(v:errors, '/dev/stderr')
+  cquit
+endif
+qall!